@@ -19,6 +19,9 @@
 #include <linux/cred.h>
 #include <linux/buffer_head.h>
 #include <linux/capability.h>
+#include <linux/crc16.h>
+#include <linux/blkdev.h>
+#include <linux/list_sort.h>
 
 /*
  * balloc.c contains the blocks allocation and deallocation routines
@@ -55,6 +58,10 @@ struct ext2_group_desc * ext2_get_group_desc(struct super_block * sb,
 
 	group_desc = block_group >> EXT2_DESC_PER_BLOCK_BITS(sb);
 	offset = block_group & (EXT2_DESC_PER_BLOCK(sb) - 1);
+	if (!smp_load_acquire(&sbi->s_group_desc[group_desc]) &&
+	    test_opt(sb, LAZY_GDT) &&
+	    ext2_load_group_desc(sb, group_desc))
+		return NULL;
 	if (!sbi->s_group_desc[group_desc]) {
 		WARN(1, "Group descriptor not loaded - "
 		     "block_group = %d, group_desc = %lu, desc = %lu",
@@ -68,6 +75,60 @@ struct ext2_group_desc * ext2_get_group_desc(struct super_block * sb,
 	return desc + offset;
 }
 
+/*
+ * ext2_get_group_desc() for loops over many groups, which may hold spinlocks:
+ * a descriptor not read in yet under -o lazy_gdt is skipped, not waited for.
+ */
+struct ext2_group_desc *ext2_peek_group_desc(struct super_block *sb,
+					     unsigned int block_group,
+					     struct buffer_head **bh)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	if (test_opt(sb, LAZY_GDT) && block_group < sbi->s_groups_count &&
+	    !smp_load_acquire(&sbi->s_group_desc[block_group >>
+					EXT2_DESC_PER_BLOCK_BITS(sb)]))
+		return NULL;
+	return ext2_get_group_desc(sb, block_group, bh);
+}
+
+/*
+ * With uninit_bg (RO_COMPAT_GDT_CSUM) every descriptor carries a crc16 of
+ * the fs uuid, its group number and itself, the same one ext4 uses.  It is
+ * set under the group lock after each change to the descriptor.
+ */
+static __le16 ext2_group_desc_csum(struct super_block *sb,
+				   unsigned int block_group,
+				   struct ext2_group_desc *desc)
+{
+	struct ext2_super_block *es = EXT2_SB(sb)->s_es;
+	__le32 le_group = cpu_to_le32(block_group);
+	u16 crc;
+
+	crc = crc16(~0, es->s_uuid, sizeof(es->s_uuid));
+	crc = crc16(crc, (u8 *)&le_group, sizeof(le_group));
+	crc = crc16(crc, (u8 *)desc, offsetof(struct ext2_group_desc,
+					      bg_checksum));
+	return cpu_to_le16(crc);
+}
+
+void ext2_group_desc_csum_set(struct super_block *sb, unsigned int block_group,
+			      struct ext2_group_desc *desc)
+{
+	if (EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_GDT_CSUM))
+		desc->bg_checksum = ext2_group_desc_csum(sb, block_group, desc);
+}
+
+int ext2_group_desc_csum_verify(struct super_block *sb,
+				unsigned int block_group,
+				struct ext2_group_desc *desc)
+{
+	if (EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    desc->bg_checksum != ext2_group_desc_csum(sb, block_group, desc))
+		return 0;
+	return 1;
+}
+
 static int ext2_valid_block_bitmap(struct super_block *sb,
 					struct ext2_group_desc *desc,
 					unsigned int block_group,
@@ -119,20 +180,71 @@ err_out:
 	return 0;
 }
 
+/*
+ * Build the block bitmap of an EXT2_BG_BLOCK_UNINIT group: only the group's
+ * own metadata is in use, and whatever lies past the end of a short last
+ * group.
+ */
+static void ext2_init_block_bitmap(struct super_block *sb,
+				   unsigned int block_group,
+				   struct ext2_group_desc *desc,
+				   struct buffer_head *bh)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	ext2_fsblk_t start = ext2_group_first_block_no(sb, block_group);
+	ext2_grpblk_t nr = ext2_group_last_block_no(sb, block_group) - start + 1;
+	unsigned long first_meta_bg = le32_to_cpu(sbi->s_es->s_first_meta_bg);
+	unsigned long meta = ext2_bg_has_super(sb, block_group);
+	unsigned long idx;
+	ext2_grpblk_t bit;
+
+	/* the superblock copy, and descriptors and reserved ones after it */
+	if (!EXT2_HAS_INCOMPAT_FEATURE(sb, EXT2_FEATURE_INCOMPAT_META_BG)) {
+		if (meta)
+			meta += sbi->s_gdb_count +
+				le16_to_cpu(sbi->s_es->s_reserved_gdt_blocks);
+	} else if (block_group < first_meta_bg * EXT2_DESC_PER_BLOCK(sb)) {
+		if (meta)
+			meta += first_meta_bg +
+				le16_to_cpu(sbi->s_es->s_reserved_gdt_blocks);
+	} else {
+		idx = block_group % EXT2_DESC_PER_BLOCK(sb);
+		if (idx == 0 || idx == 1 || idx == EXT2_DESC_PER_BLOCK(sb) - 1)
+			meta++;
+	}
+
+	memset(bh->b_data, 0, sb->s_blocksize);
+	for (bit = 0; bit < meta; bit++)
+		ext2_set_bit(bit, bh->b_data);
+	ext2_set_bit(le32_to_cpu(desc->bg_block_bitmap) - start, bh->b_data);
+	ext2_set_bit(le32_to_cpu(desc->bg_inode_bitmap) - start, bh->b_data);
+	bit = le32_to_cpu(desc->bg_inode_table) - start;
+	for (idx = 0; idx < sbi->s_itb_per_group; idx++)
+		ext2_set_bit(bit + idx, bh->b_data);
+	for (bit = nr; bit < sb->s_blocksize * 8; bit++)
+		ext2_set_bit(bit, bh->b_data);
+}
+
 /*
  * Read the bitmap for a given block_group,and validate the
  * bits for block/inode/inode tables are set in the bitmaps
  *
  * Return buffer_head on success or NULL in case of failure.
+ *
+ * @pin adds the bitmap to the cache of pinned bitmaps; scans of every
+ * group pass false so as not to push the groups in use out of it.
  */
 static struct buffer_head *
-read_block_bitmap(struct super_block *sb, unsigned int block_group)
+__read_block_bitmap(struct super_block *sb, unsigned int block_group, bool pin)
 {
 	struct ext2_group_desc * desc;
 	struct buffer_head * bh = NULL;
 	ext2_fsblk_t bitmap_blk;
 	int ret;
 
+	bh = ext2_bitmap_cache_get(sb, block_group, EXT2_BLOCK_BITMAP);
+	if (bh)
+		return bh;
 	desc = ext2_get_group_desc(sb, block_group, NULL);
 	if (!desc)
 		return NULL;
@@ -145,9 +257,24 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 			    block_group, le32_to_cpu(desc->bg_block_bitmap));
 		return NULL;
 	}
+	/*
+	 * Never written: build it once.  The flag is only cleared once the
+	 * bitmap has been changed, so a later caller must not rebuild it.
+	 */
+	if (EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    (desc->bg_flags & cpu_to_le16(EXT2_BG_BLOCK_UNINIT))) {
+		lock_buffer(bh);
+		if (!buffer_ext2_uninit(bh)) {
+			ext2_init_block_bitmap(sb, block_group, desc, bh);
+			set_buffer_uptodate(bh);
+			set_buffer_ext2_uninit(bh);
+		}
+		unlock_buffer(bh);
+		goto out;
+	}
 	ret = bh_read(bh, 0);
 	if (ret > 0)
-		return bh;
+		goto out;
 	if (ret < 0) {
 		brelse(bh);
 		ext2_error(sb, __func__,
@@ -157,14 +284,24 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 		return NULL;
 	}
 
-	ext2_valid_block_bitmap(sb, desc, block_group, bh);
-	/*
-	 * file system mounted not to panic on error, continue with corrupt
-	 * bitmap
-	 */
+	if (!ext2_valid_block_bitmap(sb, desc, block_group, bh))
+		/*
+		 * file system mounted not to panic on error, continue with
+		 * corrupt bitmap, but check it again next time
+		 */
+		return bh;
+out:
+	if (pin)
+		ext2_bitmap_cache_add(sb, block_group, EXT2_BLOCK_BITMAP, bh);
 	return bh;
 }
 
+static inline struct buffer_head *
+read_block_bitmap(struct super_block *sb, unsigned int block_group)
+{
+	return __read_block_bitmap(sb, block_group, true);
+}
+
 static void group_adjust_blocks(struct super_block *sb, int group_no,
 	struct ext2_group_desc *desc, struct buffer_head *bh, int count)
 {
@@ -175,7 +312,12 @@ static void group_adjust_blocks(struct super_block *sb, int group_no,
 		spin_lock(sb_bgl_lock(sbi, group_no));
 		free_blocks = le16_to_cpu(desc->bg_free_blocks_count);
 		desc->bg_free_blocks_count = cpu_to_le16(free_blocks + count);
+		if (EXT2_HAS_RO_COMPAT_FEATURE(sb,
+					       EXT2_FEATURE_RO_COMPAT_GDT_CSUM))
+			desc->bg_flags &= cpu_to_le16(~EXT2_BG_BLOCK_UNINIT);
+		ext2_group_desc_csum_set(sb, group_no, desc);
 		spin_unlock(sb_bgl_lock(sbi, group_no));
+		ext2_group_info_update(sb, group_no, desc);
 		mark_buffer_dirty(bh);
 	}
 }
@@ -473,14 +615,14 @@ void ext2_discard_reservation(struct inode *inode)
 	}
 }
 
-/**
- * ext2_free_blocks() -- Free given blocks and update quota and i_blocks
- * @inode:		inode
- * @block:		start physical block to free
- * @count:		number of blocks to free
+/*
+ * Clear @count bits from @block in the block bitmaps, and add the blocks
+ * to the group descriptors.  Returns how many were actually in use; the
+ * caller adds those to the free blocks counter.
  */
-void ext2_free_blocks(struct inode * inode, ext2_fsblk_t block,
-		      unsigned long count)
+static unsigned long ext2_release_blocks(struct super_block *sb,
+					 ext2_fsblk_t block,
+					 unsigned long count)
 {
 	struct buffer_head *bitmap_bh = NULL;
 	struct buffer_head * bh2;
@@ -488,21 +630,11 @@ void ext2_free_blocks(struct inode * inode, ext2_fsblk_t block,
 	unsigned long bit;
 	unsigned long i;
 	unsigned long overflow;
-	struct super_block * sb = inode->i_sb;
 	struct ext2_sb_info * sbi = EXT2_SB(sb);
 	struct ext2_group_desc * desc;
 	struct ext2_super_block * es = sbi->s_es;
 	unsigned freed = 0, group_freed;
 
-	if (!ext2_data_block_valid(sbi, block, count)) {
-		ext2_error (sb, "ext2_free_blocks",
-			    "Freeing blocks not in datazone - "
-			    "block = %lu, count = %lu", block, count);
-		goto error_return;
-	}
-
-	ext2_debug ("freeing block(s) %lu-%lu\n", block, block + count - 1);
-
 do_more:
 	overflow = 0;
 	block_group = (block - le32_to_cpu(es->s_first_data_block)) /
@@ -563,13 +695,368 @@ do_more:
 	}
 error_return:
 	brelse(bitmap_bh);
-	if (freed) {
+	return freed;
+}
+
+/*
+ * -o discard: rather than discarding blocks one free at a time, from the
+ * free path, freed runs are queued on s_discard_list, merged with the run
+ * before them when they continue it, and s_discard_work discards whatever
+ * has gathered in EXT2_DISCARD_DELAY in one batch of bios.  The blocks
+ * only go back to the bitmaps after that, so nothing can be allocated and
+ * written there before its discard has completed.  Until then they count
+ * as free in statfs, and an allocation about to fail with ENOSPC waits for
+ * them.
+ */
+#define EXT2_DISCARD_DELAY	HZ
+/* queued blocks that start the work without waiting out the delay */
+#define EXT2_DISCARD_MAX	32768
+
+struct ext2_discard_range {
+	struct list_head	list;
+	ext2_fsblk_t		start;
+	unsigned long		count;
+};
+
+/*
+ * Queue @count blocks from @block for discard.  Returns false if there is
+ * no memory for that, and the caller has to release them itself.
+ */
+static bool ext2_discard_queue(struct super_block *sb, ext2_fsblk_t block,
+			       unsigned long count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_discard_range *r, *last;
+	unsigned long pending;
+
+	r = NULL;
+	spin_lock(&sbi->s_discard_lock);
+	last = list_last_entry_or_null(&sbi->s_discard_list,
+				       struct ext2_discard_range, list);
+	if (!last || last->start + last->count != block) {
+		spin_unlock(&sbi->s_discard_lock);
+		r = kmalloc(sizeof(*r), GFP_NOFS);
+		if (!r)
+			return false;
+		r->start = block;
+		r->count = count;
+		spin_lock(&sbi->s_discard_lock);
+		list_add_tail(&r->list, &sbi->s_discard_list);
+	} else {
+		last->count += count;
+	}
+	sbi->s_discard_blocks += count;
+	pending = sbi->s_discard_blocks;
+	spin_unlock(&sbi->s_discard_lock);
+
+	if (pending >= EXT2_DISCARD_MAX)
+		mod_delayed_work(system_unbound_wq, &sbi->s_discard_work, 0);
+	else
+		queue_delayed_work(system_unbound_wq, &sbi->s_discard_work,
+				   EXT2_DISCARD_DELAY);
+	return true;
+}
+
+/* Add the discard of @count blocks from @block to the chain at @biop. */
+static int ext2_discard_bio(struct super_block *sb, ext2_fsblk_t block,
+			    unsigned long count, struct bio **biop)
+{
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+
+	return __blkdev_issue_discard(sb->s_bdev, (sector_t)block << shift,
+				      (sector_t)count << shift, GFP_NOFS,
+				      biop);
+}
+
+/* Submit the chain built by ext2_discard_bio() and wait for all of it. */
+static int ext2_discard_wait(struct bio *bio)
+{
+	int err;
+
+	if (!bio)
+		return 0;
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	return err == -EOPNOTSUPP ? 0 : err;
+}
+
+static int ext2_discard_cmp(void *priv, const struct list_head *a,
+			    const struct list_head *b)
+{
+	struct ext2_discard_range *ra, *rb;
+
+	ra = list_entry(a, struct ext2_discard_range, list);
+	rb = list_entry(b, struct ext2_discard_range, list);
+	return ra->start > rb->start;
+}
+
+void ext2_discard_work(struct work_struct *work)
+{
+	struct ext2_sb_info *sbi = container_of(to_delayed_work(work),
+						struct ext2_sb_info,
+						s_discard_work);
+	struct super_block *sb = sbi->s_sb;
+	struct ext2_discard_range *r, *prev, *tmp;
+	struct blk_plug plug;
+	struct bio *bio = NULL;
+	unsigned long freed = 0;
+	LIST_HEAD(list);
+
+	/* a frozen fs is picked up again by ext2_unfreeze() */
+	if (!sb_start_intwrite_trylock(sb))
+		return;
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_list, &list);
+	spin_unlock(&sbi->s_discard_lock);
+
+	/* runs freed by different files may still meet once sorted */
+	list_sort(NULL, &list, ext2_discard_cmp);
+	prev = NULL;
+	list_for_each_entry_safe(r, tmp, &list, list) {
+		if (prev && prev->start + prev->count == r->start) {
+			prev->count += r->count;
+			list_del(&r->list);
+			kfree(r);
+			continue;
+		}
+		prev = r;
+	}
+
+	blk_start_plug(&plug);
+	list_for_each_entry(r, &list, list) {
+		/* the blocks are released whether or not it worked */
+		if (ext2_discard_bio(sb, r->start, r->count, &bio))
+			break;
+	}
+	blk_finish_plug(&plug);
+	ext2_discard_wait(bio);
+
+	list_for_each_entry_safe(r, tmp, &list, list) {
+		freed += ext2_release_blocks(sb, r->start, r->count);
+		spin_lock(&sbi->s_discard_lock);
+		sbi->s_discard_blocks -= r->count;
+		spin_unlock(&sbi->s_discard_lock);
+		kfree(r);
+		cond_resched();
+	}
+	if (freed)
 		percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+	sb_end_intwrite(sb);
+}
+
+void ext2_flush_discards(struct super_block *sb)
+{
+	if (ext2_discards_pending(sb))
+		flush_delayed_work(&EXT2_SB(sb)->s_discard_work);
+}
+
+/**
+ * ext2_free_blocks() -- Free given blocks and update quota and i_blocks
+ * @inode:		inode
+ * @block:		start physical block to free
+ * @count:		number of blocks to free
+ */
+void ext2_free_blocks(struct inode * inode, ext2_fsblk_t block,
+		      unsigned long count)
+{
+	struct super_block * sb = inode->i_sb;
+	struct ext2_sb_info * sbi = EXT2_SB(sb);
+	unsigned long freed;
+
+	if (!ext2_data_block_valid(sbi, block, count)) {
+		ext2_error (sb, "ext2_free_blocks",
+			    "Freeing blocks not in datazone - "
+			    "block = %lu, count = %lu", block, count);
+		return;
+	}
+
+	ext2_debug ("freeing block(s) %lu-%lu\n", block, block + count - 1);
+
+	if (test_opt(sb, DISCARD) && ext2_discard_queue(sb, block, count)) {
+		freed = count;
+	} else {
+		freed = ext2_release_blocks(sb, block, count);
+		if (freed)
+			percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+	}
+	if (freed) {
 		dquot_free_block_nodirty(inode, freed);
 		mark_inode_dirty(inode);
 	}
 }
 
+/*
+ * Blocks of unlinked inodes waiting for deferred reclamation, and blocks
+ * waiting for their discard, are about to be freed.  Wait for them once
+ * before failing an allocation with ENOSPC.
+ */
+int ext2_should_retry_alloc(struct super_block *sb, int *retries)
+{
+	if ((!ext2_orphans_pending(sb) && !ext2_discards_pending(sb)) ||
+	    (*retries)++)
+		return 0;
+	ext2_flush_orphans(sb);
+	ext2_flush_discards(sb);
+	return 1;
+}
+
+/**
+ * ext2_free_batch_flush() -- release the blocks queued in a free batch
+ * @fb:		batch to flush
+ *
+ * All runs in @fb live in the same block group, so the bitmap is read once,
+ * the group descriptor is updated under a single hold of the group lock,
+ * and quota and the free blocks counter are adjusted once for the whole
+ * batch.  The bits are cleared atomically as in ext2_free_blocks(): the
+ * allocator sets them without the group lock.
+ */
+void ext2_free_batch_flush(struct ext2_free_batch *fb)
+{
+	struct inode *inode = fb->fb_inode;
+	struct super_block *sb = inode->i_sb;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long group = fb->fb_group;
+	struct buffer_head *bitmap_bh, *bh2;
+	struct ext2_group_desc *desc;
+	ext2_fsblk_t group_first = ext2_group_first_block_no(sb, group);
+	ext2_fsblk_t itable;
+	ext2_grpblk_t bit, end;
+	unsigned long freed = 0, queued = 0, bad = 0;
+	ext2_fsblk_t first_bad = 0;
+	int i;
+
+	if (!fb->fb_nr)
+		return;
+
+	if (test_opt(sb, DISCARD)) {
+		/* the bitmap is updated as the runs are discarded */
+		for (i = 0; i < fb->fb_nr; i++) {
+			ext2_fsblk_t block = group_first + fb->fb_start[i];
+
+			if (ext2_discard_queue(sb, block, fb->fb_count[i]))
+				queued += fb->fb_count[i];
+			else
+				freed += ext2_release_blocks(sb, block,
+							     fb->fb_count[i]);
+		}
+		goto out;
+	}
+
+	bitmap_bh = read_block_bitmap(sb, group);
+	if (!bitmap_bh)
+		goto out;
+	desc = ext2_get_group_desc(sb, group, &bh2);
+	if (!desc)
+		goto out_brelse;
+
+	itable = le32_to_cpu(desc->bg_inode_table);
+	for (i = 0; i < fb->fb_nr; i++) {
+		ext2_fsblk_t block = group_first + fb->fb_start[i];
+		unsigned long count = fb->fb_count[i];
+
+		if (in_range(le32_to_cpu(desc->bg_block_bitmap), block, count) ||
+		    in_range(le32_to_cpu(desc->bg_inode_bitmap), block, count) ||
+		    in_range(block, itable, sbi->s_itb_per_group) ||
+		    in_range(block + count - 1, itable, sbi->s_itb_per_group)) {
+			ext2_error(sb, __func__,
+				   "Freeing blocks in system zones - "
+				   "Block = %lu, count = %lu", block, count);
+			fb->fb_count[i] = 0;
+		}
+	}
+
+	for (i = 0; i < fb->fb_nr; i++) {
+		end = fb->fb_start[i] + fb->fb_count[i];
+		for (bit = fb->fb_start[i]; bit < end; bit++) {
+			if (ext2_clear_bit_atomic(sb_bgl_lock(sbi, group), bit,
+						  bitmap_bh->b_data)) {
+				freed++;
+			} else if (!bad++) {
+				first_bad = group_first + bit;
+			}
+		}
+	}
+	spin_lock(sb_bgl_lock(sbi, group));
+	le16_add_cpu(&desc->bg_free_blocks_count, freed);
+	ext2_group_desc_csum_set(sb, group, desc);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	ext2_group_info_update(sb, group, desc);
+
+	if (bad)
+		ext2_error(sb, __func__,
+			   "bit already cleared for %lu blocks, first %lu",
+			   bad, first_bad);
+
+	mark_buffer_dirty(bitmap_bh);
+	if (sb->s_flags & SB_SYNCHRONOUS)
+		sync_dirty_buffer(bitmap_bh);
+	if (freed)
+		mark_buffer_dirty(bh2);
+out_brelse:
+	brelse(bitmap_bh);
+out:
+	fb->fb_nr = 0;
+	if (freed)
+		percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+	if (freed + queued) {
+		dquot_free_block_nodirty(inode, freed + queued);
+		mark_inode_dirty(inode);
+	}
+}
+
+/**
+ * ext2_free_batch_add() -- queue blocks for freeing
+ * @fb:		batch to add to
+ * @block:	first block to free
+ * @count:	number of blocks to free
+ *
+ * Runs that cross a group boundary are split.  The batch is flushed whenever
+ * a run from another group arrives or it runs out of slots, so a file whose
+ * blocks are laid out group by group costs one bitmap update per group.
+ */
+void ext2_free_batch_add(struct ext2_free_batch *fb, ext2_fsblk_t block,
+			 unsigned long count)
+{
+	struct super_block *sb = fb->fb_inode->i_sb;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long group;
+	ext2_grpblk_t bit;
+	unsigned long len;
+	int last;
+
+	if (!ext2_data_block_valid(sbi, block, count)) {
+		ext2_error(sb, __func__,
+			   "Freeing blocks not in datazone - "
+			   "block = %lu, count = %lu", block, count);
+		return;
+	}
+
+	while (count) {
+		group = (block - le32_to_cpu(sbi->s_es->s_first_data_block)) /
+			EXT2_BLOCKS_PER_GROUP(sb);
+		bit = (block - le32_to_cpu(sbi->s_es->s_first_data_block)) %
+			EXT2_BLOCKS_PER_GROUP(sb);
+		len = min_t(unsigned long, count,
+			    EXT2_BLOCKS_PER_GROUP(sb) - bit);
+
+		if (fb->fb_nr &&
+		    (group != fb->fb_group || fb->fb_nr == EXT2_FREE_BATCH))
+			ext2_free_batch_flush(fb);
+
+		last = fb->fb_nr - 1;
+		if (last >= 0 && fb->fb_start[last] + fb->fb_count[last] == bit) {
+			fb->fb_count[last] += len;
+		} else {
+			fb->fb_group = group;
+			fb->fb_start[fb->fb_nr] = bit;
+			fb->fb_count[fb->fb_nr] = len;
+			fb->fb_nr++;
+		}
+		block += len;
+		count -= len;
+	}
+}
+
 /**
  * bitmap_search_next_usable_block()
  * @start:		the starting block (group relative) of the search
@@ -1227,6 +1714,7 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
 	unsigned short windowsz = 0;
 	unsigned long ngroups;
 	unsigned long num = *count;
+	int retries = 0;
 	int ret;
 
 	*errp = -ENOSPC;
@@ -1259,7 +1747,10 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
 			my_rsv = &block_i->rsv_window_node;
 	}
 
+retry_enospc:
 	if (!ext2_has_free_blocks(sbi)) {
+		if (ext2_should_retry_alloc(sb, &retries))
+			goto retry_enospc;
 		*errp = -ENOSPC;
 		goto out;
 	}
@@ -1319,9 +1810,13 @@ retry_alloc:
 		group_no++;
 		if (group_no >= ngroups)
 			group_no = 0;
-		gdp = ext2_get_group_desc(sb, group_no, &gdp_bh);
-		if (!gdp)
+		gdp = ext2_peek_group_desc(sb, group_no, &gdp_bh);
+		if (!gdp) {
+			/* not read in yet, see ext2_load_group_desc() */
+			if (test_opt(sb, LAZY_GDT))
+				continue;
 			goto io_error;
+		}
 
 		free_blocks = le16_to_cpu(gdp->bg_free_blocks_count);
 		/*
@@ -1363,6 +1858,16 @@ retry_alloc:
 		group_no = goal_group;
 		goto retry_alloc;
 	}
+	/* the free blocks may be in groups not read in yet */
+	if (ext2_gdt_partial(sbi)) {
+		ext2_load_group_descs(sb);
+		if (!ext2_gdt_partial(sbi)) {
+			group_no = goal_group;
+			goto retry_alloc;
+		}
+	}
+	if (ext2_should_retry_alloc(sb, &retries))
+		goto retry_enospc;
 	/* No space left on the device */
 	*errp = -ENOSPC;
 	goto out;
@@ -1451,6 +1956,11 @@ unsigned long ext2_count_free_blocks (struct super_block * sb)
 	unsigned long bitmap_count, x;
 	struct ext2_super_block *es;
 
+	/* until every descriptor is in, the counter is all there is */
+	if (ext2_gdt_partial(EXT2_SB(sb)))
+		return percpu_counter_sum_positive(
+				&EXT2_SB(sb)->s_freeblocks_counter);
+
 	es = EXT2_SB(sb)->s_es;
 	desc_count = 0;
 	bitmap_count = 0;
@@ -1476,6 +1986,10 @@ unsigned long ext2_count_free_blocks (struct super_block * sb)
 		desc_count, bitmap_count);
 	return bitmap_count;
 #else
+	/* until every descriptor is in, the counter is all there is */
+	if (ext2_gdt_partial(EXT2_SB(sb)))
+		return percpu_counter_sum_positive(
+				&EXT2_SB(sb)->s_freeblocks_counter);
 	for (i = 0; i < EXT2_SB(sb)->s_groups_count; i++) {
 		desc = ext2_get_group_desc(sb, i, NULL);
 		if (!desc)
@@ -1486,6 +2000,268 @@ unsigned long ext2_count_free_blocks (struct super_block * sb)
 #endif
 }
 
+/* free runs of a group taken out of the bitmap and discarded at a time */
+#define EXT2_TRIM_BATCH		64
+
+/*
+ * Discard the free runs of at least @minblocks blocks between bits @start
+ * and @max of @group.  Each run is taken bit by bit with
+ * ext2_set_bit_atomic(), as the allocator takes blocks, so that a block
+ * the allocator got first ends the run instead of being discarded.  The
+ * bits stay set while the discard is in flight, so nothing is allocated
+ * there meanwhile, and are cleared again afterwards; the descriptor counts
+ * never change.
+ */
+static int ext2_trim_group(struct super_block *sb, unsigned int group,
+			   ext2_grpblk_t start, ext2_grpblk_t max,
+			   ext2_grpblk_t minblocks, unsigned long *trimmed)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	ext2_fsblk_t group_first = ext2_group_first_block_no(sb, group);
+	ext2_grpblk_t run_start[EXT2_TRIM_BATCH], run_end[EXT2_TRIM_BATCH];
+	struct buffer_head *bitmap_bh;
+	struct blk_plug plug;
+	struct bio *bio;
+	ext2_grpblk_t end, bit;
+	int nr, i, err = 0;
+
+	bitmap_bh = __read_block_bitmap(sb, group, false);
+	if (!bitmap_bh)
+		return -EIO;
+
+	while (start <= max && !err) {
+		nr = 0;
+		while (nr < EXT2_TRIM_BATCH && start <= max) {
+			start = ext2_find_next_zero_bit(bitmap_bh->b_data,
+							max + 1, start);
+			if (start > max)
+				break;
+			end = ext2_find_next_bit(bitmap_bh->b_data, max + 1,
+						 start);
+			if (end - start < minblocks) {
+				start = end + 1;
+				continue;
+			}
+			for (bit = start; bit < end; bit++)
+				if (ext2_set_bit_atomic(sb_bgl_lock(sbi, group),
+							bit, bitmap_bh->b_data))
+					break;
+			if (bit - start >= minblocks) {
+				run_start[nr] = start;
+				run_end[nr++] = bit;
+			} else {
+				/* too short once the allocator got in first */
+				for (i = start; i < bit; i++)
+					ext2_clear_bit_atomic(
+						sb_bgl_lock(sbi, group), i,
+						bitmap_bh->b_data);
+			}
+			start = bit + 1;
+		}
+		if (!nr)
+			break;
+
+		bio = NULL;
+		blk_start_plug(&plug);
+		for (i = 0; i < nr && !err; i++)
+			err = ext2_discard_bio(sb, group_first + run_start[i],
+					       run_end[i] - run_start[i], &bio);
+		blk_finish_plug(&plug);
+		if (!err)
+			err = ext2_discard_wait(bio);
+		else
+			ext2_discard_wait(bio);
+
+		for (i = 0; i < nr; i++) {
+			for (bit = run_start[i]; bit < run_end[i]; bit++)
+				ext2_clear_bit_atomic(sb_bgl_lock(sbi, group),
+						      bit, bitmap_bh->b_data);
+			if (!err)
+				*trimmed += run_end[i] - run_start[i];
+		}
+
+		if (!err && fatal_signal_pending(current))
+			err = -ERESTARTSYS;
+		cond_resched();
+	}
+	brelse(bitmap_bh);
+	return err;
+}
+
+/**
+ * ext2_trim_fs() -- discard the free space in a range, for FITRIM
+ * @sb:		superblock
+ * @range:	byte range and minimum run length; len is set to what was
+ *		discarded
+ */
+int ext2_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	ext2_fsblk_t first_data = le32_to_cpu(sbi->s_es->s_first_data_block);
+	ext2_fsblk_t blocks = le32_to_cpu(sbi->s_es->s_blocks_count);
+	unsigned int bits = sb->s_blocksize_bits;
+	struct ext2_group_desc *desc;
+	ext2_fsblk_t start, end, first, last;
+	ext2_grpblk_t minblocks;
+	unsigned long group, last_group, trimmed = 0;
+	int err = 0;
+
+	if (range->start >> bits >= blocks || range->len >> bits == 0 ||
+	    range->minlen >> bits > EXT2_BLOCKS_PER_GROUP(sb))
+		return -EINVAL;
+	start = max_t(u64, range->start >> bits, first_data);
+	end = min_t(u64, (range->start >> bits) + (range->len >> bits),
+		    blocks) - 1;
+	/* runs shorter than the device can discard are no use */
+	minblocks = max_t(u64, range->minlen >> bits,
+			  DIV_ROUND_UP(bdev_discard_granularity(sb->s_bdev),
+				       sb->s_blocksize));
+	minblocks = max(minblocks, 1);
+
+	if (end < start)
+		goto out;
+	group = (start - first_data) / EXT2_BLOCKS_PER_GROUP(sb);
+	last_group = (end - first_data) / EXT2_BLOCKS_PER_GROUP(sb);
+	for (; group <= last_group; group++) {
+		desc = ext2_get_group_desc(sb, group, NULL);
+		if (!desc) {
+			err = -EIO;
+			break;
+		}
+		if (le16_to_cpu(desc->bg_free_blocks_count) < minblocks)
+			continue;
+		first = ext2_group_first_block_no(sb, group);
+		last = ext2_group_last_block_no(sb, group);
+		err = ext2_trim_group(sb, group, max(start, first) - first,
+				      min(end, last) - first, minblocks,
+				      &trimmed);
+		if (err)
+			break;
+	}
+out:
+	range->len = (u64)trimmed << bits;
+	return err;
+}
+
+/*
+ * EXT2_IOC_FRAGSTAT for the filesystem: the runs of set and clear bits of
+ * every block bitmap, one bitmap at a time.  With EXT2_FRAGSTAT_PARALLEL
+ * the groups are split between up to one work item per CPU, as the
+ * descriptor checks at mount are.  Runs end at group boundaries, as
+ * allocations do.  The bitmaps are read without the group locks, so on a
+ * busy filesystem the result is a snapshot only approximately, and are not
+ * pinned, so that one scan leaves behind no more than the buffer cache
+ * cares to keep.
+ */
+#define EXT2_FRAGSTAT_CHUNK	256
+
+struct ext2_fragstat_range {
+	struct work_struct	work;
+	struct super_block	*sb;
+	unsigned long		first, end;
+	struct ext2_fragstat	fr;
+	int			err;
+};
+
+static void ext2_fragstat_group(struct super_block *sb, unsigned int group,
+				struct buffer_head *bitmap_bh,
+				struct ext2_fragstat *fr)
+{
+	ext2_grpblk_t nbits = ext2_group_last_block_no(sb, group) -
+			      ext2_group_first_block_no(sb, group) + 1;
+	ext2_grpblk_t bit = 0, next;
+
+	while (bit < nbits) {
+		next = ext2_find_next_zero_bit(bitmap_bh->b_data, nbits, bit);
+		if (next > bit) {
+			fr->fr_blocks += next - bit;
+			fr->fr_extents++;
+			fr->fr_max_extent = max_t(u64, fr->fr_max_extent,
+						  next - bit);
+		}
+		if (next >= nbits)
+			break;
+		bit = ext2_find_next_bit(bitmap_bh->b_data, nbits, next);
+		fr->fr_free_blocks += bit - next;
+		fr->fr_free_extents++;
+		fr->fr_max_free_extent = max_t(u64, fr->fr_max_free_extent,
+					       bit - next);
+	}
+}
+
+static void ext2_fragstat_range(struct ext2_fragstat_range *r)
+{
+	struct buffer_head *bitmap_bh;
+	unsigned long group;
+
+	for (group = r->first; group < r->end; group++) {
+		bitmap_bh = __read_block_bitmap(r->sb, group, false);
+		if (!bitmap_bh) {
+			r->err = -EIO;
+			return;
+		}
+		ext2_fragstat_group(r->sb, group, bitmap_bh, &r->fr);
+		brelse(bitmap_bh);
+		cond_resched();
+	}
+}
+
+static void ext2_fragstat_work(struct work_struct *work)
+{
+	ext2_fragstat_range(container_of(work, struct ext2_fragstat_range,
+					 work));
+}
+
+static void ext2_fragstat_add(struct ext2_fragstat *to,
+			      struct ext2_fragstat *from)
+{
+	to->fr_blocks += from->fr_blocks;
+	to->fr_extents += from->fr_extents;
+	to->fr_max_extent = max(to->fr_max_extent, from->fr_max_extent);
+	to->fr_free_blocks += from->fr_free_blocks;
+	to->fr_free_extents += from->fr_free_extents;
+	to->fr_max_free_extent = max(to->fr_max_free_extent,
+				     from->fr_max_free_extent);
+}
+
+int ext2_fs_fragstat(struct super_block *sb, struct ext2_fragstat *fr)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_fragstat_range *r, one = { };
+	unsigned long chunk, nr = 1, i;
+	int err = 0;
+
+	if (fr->fr_flags & EXT2_FRAGSTAT_PARALLEL)
+		nr = min_t(unsigned long, num_online_cpus(),
+			   DIV_ROUND_UP(sbi->s_groups_count,
+					EXT2_FRAGSTAT_CHUNK));
+	r = nr > 1 ? kcalloc(nr, sizeof(*r), GFP_KERNEL) : NULL;
+	if (!r) {
+		one.sb = sb;
+		one.end = sbi->s_groups_count;
+		ext2_fragstat_range(&one);
+		ext2_fragstat_add(fr, &one.fr);
+		return one.err;
+	}
+
+	chunk = DIV_ROUND_UP(sbi->s_groups_count, nr);
+	for (i = 0; i < nr; i++) {
+		r[i].sb = sb;
+		r[i].first = i * chunk;
+		r[i].end = min(r[i].first + chunk, sbi->s_groups_count);
+		INIT_WORK(&r[i].work, ext2_fragstat_work);
+		queue_work(system_unbound_wq, &r[i].work);
+	}
+	for (i = 0; i < nr; i++) {
+		flush_work(&r[i].work);
+		ext2_fragstat_add(fr, &r[i].fr);
+		if (r[i].err)
+			err = r[i].err;
+	}
+	kfree(r);
+	return err;
+}
+
 static inline int test_root(int a, int b)
 {
 	int num = b;
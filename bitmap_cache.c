@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/ext2/bitmap_cache.c
+ *
+ * Pinned block and inode bitmaps of recently used groups.
+ *
+ * read_block_bitmap() and read_inode_bitmap() only validate a bitmap when
+ * it has to be read from disk, but a buffer nobody holds goes with its
+ * page once the block device mapping is reclaimed, and a large streaming
+ * read is enough for that.  The next allocation in the group then waits
+ * for the bitmap to be read and checked again.  Here every bitmap read is
+ * kept referenced from its ext2_group_info, so it stays in memory and up
+ * to date, and the next reader of the group takes it without going
+ * through the buffer cache at all.  Scans of every group (FITRIM,
+ * EXT2_IOC_FRAGSTAT) do not add what they read.
+ *
+ * At most EXT2_BITMAP_CACHE_GROUPS groups are pinned per filesystem.  They
+ * are on s_bitmap_lru, and a per-filesystem shrinker unpins them from its
+ * cold end, giving groups used since the last pass a second chance.
+ *
+ * Locking: the group lock protects gi_bitmap[], so lookups only take that.
+ * s_bitmap_lock protects s_bitmap_lru and s_bitmap_nr, and nests outside
+ * the group locks.
+ */
+
+#include "ext2.h"
+#include <linux/buffer_head.h>
+#include <linux/shrinker.h>
+
+/* 2 blocks a group: 8MB at most with 4k blocks */
+#define EXT2_BITMAP_CACHE_GROUPS	1024
+
+/*
+ * Return @type's bitmap of @group with a reference the caller drops with
+ * brelse(), or NULL if it is not pinned.
+ */
+struct buffer_head *ext2_bitmap_cache_get(struct super_block *sb,
+					  unsigned int group, int type)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_info *gi = &sbi->s_group_info[group];
+	struct buffer_head *bh;
+
+	if (!READ_ONCE(gi->gi_bitmap[type]))
+		return NULL;
+	spin_lock(sb_bgl_lock(sbi, group));
+	bh = gi->gi_bitmap[type];
+	if (bh)
+		get_bh(bh);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	if (!bh)
+		return NULL;
+	/* a failed write leaves it stale: read it again, which replaces it */
+	if (!buffer_uptodate(bh)) {
+		brelse(bh);
+		return NULL;
+	}
+	if (!READ_ONCE(gi->gi_bitmap_referenced))
+		WRITE_ONCE(gi->gi_bitmap_referenced, true);
+	return bh;
+}
+
+/* Called with s_bitmap_lock held. */
+static void ext2_bitmap_cache_unpin(struct ext2_sb_info *sbi,
+				    struct ext2_group_info *gi)
+{
+	unsigned int group = gi - sbi->s_group_info;
+	int i;
+
+	spin_lock(sb_bgl_lock(sbi, group));
+	for (i = 0; i < EXT2_NR_BITMAPS; i++) {
+		brelse(gi->gi_bitmap[i]);
+		gi->gi_bitmap[i] = NULL;
+	}
+	spin_unlock(sb_bgl_lock(sbi, group));
+	list_del_init(&gi->gi_bitmap_lru);
+	sbi->s_bitmap_nr--;
+}
+
+/*
+ * Unpin groups from the cold end of the LRU until no more than @keep are
+ * left or @nr_to_scan have been looked at.  Called with s_bitmap_lock held.
+ */
+static unsigned long __ext2_bitmap_cache_shrink(struct ext2_sb_info *sbi,
+						unsigned long keep,
+						unsigned long nr_to_scan)
+{
+	struct ext2_group_info *gi;
+	unsigned long freed = 0;
+
+	while (sbi->s_bitmap_nr > keep && nr_to_scan--) {
+		gi = list_last_entry(&sbi->s_bitmap_lru,
+				     struct ext2_group_info, gi_bitmap_lru);
+		if (READ_ONCE(gi->gi_bitmap_referenced)) {
+			WRITE_ONCE(gi->gi_bitmap_referenced, false);
+			list_move(&gi->gi_bitmap_lru, &sbi->s_bitmap_lru);
+			continue;
+		}
+		ext2_bitmap_cache_unpin(sbi, gi);
+		freed++;
+	}
+	return freed;
+}
+
+/*
+ * Pin @bh, just read or checked by the caller, as @type's bitmap of @group.
+ */
+void ext2_bitmap_cache_add(struct super_block *sb, unsigned int group,
+			   int type, struct buffer_head *bh)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_info *gi = &sbi->s_group_info[group];
+	struct buffer_head *old;
+
+	spin_lock(&sbi->s_bitmap_lock);
+	if (list_empty(&gi->gi_bitmap_lru)) {
+		/* one pass clears every referenced flag, so two are enough */
+		__ext2_bitmap_cache_shrink(sbi, EXT2_BITMAP_CACHE_GROUPS - 1,
+					   2 * sbi->s_bitmap_nr);
+		list_add(&gi->gi_bitmap_lru, &sbi->s_bitmap_lru);
+		sbi->s_bitmap_nr++;
+	}
+	spin_lock(sb_bgl_lock(sbi, group));
+	old = gi->gi_bitmap[type];
+	get_bh(bh);
+	gi->gi_bitmap[type] = bh;
+	spin_unlock(sb_bgl_lock(sbi, group));
+	spin_unlock(&sbi->s_bitmap_lock);
+	brelse(old);
+}
+
+static unsigned long ext2_bitmap_cache_count(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	struct ext2_sb_info *sbi = shrink->private_data;
+
+	return READ_ONCE(sbi->s_bitmap_nr);
+}
+
+static unsigned long ext2_bitmap_cache_scan(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	struct ext2_sb_info *sbi = shrink->private_data;
+	unsigned long freed;
+
+	spin_lock(&sbi->s_bitmap_lock);
+	freed = __ext2_bitmap_cache_shrink(sbi, 0, sc->nr_to_scan);
+	spin_unlock(&sbi->s_bitmap_lock);
+	return freed;
+}
+
+int ext2_init_bitmap_cache(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	spin_lock_init(&sbi->s_bitmap_lock);
+	INIT_LIST_HEAD(&sbi->s_bitmap_lru);
+	sbi->s_bitmap_nr = 0;
+	sbi->s_bitmap_shrinker = shrinker_alloc(0, "ext2-bitmap:%s", sb->s_id);
+	if (!sbi->s_bitmap_shrinker)
+		return -ENOMEM;
+	sbi->s_bitmap_shrinker->count_objects = ext2_bitmap_cache_count;
+	sbi->s_bitmap_shrinker->scan_objects = ext2_bitmap_cache_scan;
+	sbi->s_bitmap_shrinker->private_data = sbi;
+	shrinker_register(sbi->s_bitmap_shrinker);
+	return 0;
+}
+
+void ext2_destroy_bitmap_cache(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	shrinker_free(sbi->s_bitmap_shrinker);
+	sbi->s_bitmap_shrinker = NULL;
+	spin_lock(&sbi->s_bitmap_lock);
+	__ext2_bitmap_cache_shrink(sbi, 0, ULONG_MAX);
+	spin_unlock(&sbi->s_bitmap_lock);
+}
@@ -27,36 +27,10 @@
 #include <linux/pagemap.h>
 #include <linux/swap.h>
 #include <linux/iversion.h>
+#include <linux/uaccess.h>
 
 typedef struct ext2_dir_entry_2 ext2_dirent;
 
-/*
- * Tests against MAX_REC_LEN etc were put in place for 64k block
- * sizes; if that is not possible on this arch, we can skip
- * those tests and speed things up.
- */
-static inline unsigned ext2_rec_len_from_disk(__le16 dlen)
-{
-	unsigned len = le16_to_cpu(dlen);
-
-#if (PAGE_SIZE >= 65536)
-	if (len == EXT2_MAX_REC_LEN)
-		return 1 << 16;
-#endif
-	return len;
-}
-
-static inline __le16 ext2_rec_len_to_disk(unsigned len)
-{
-#if (PAGE_SIZE >= 65536)
-	if (len == (1 << 16))
-		return cpu_to_le16(EXT2_MAX_REC_LEN);
-	else
-		BUG_ON(len > (1 << 16));
-#endif
-	return cpu_to_le16(len);
-}
-
 /*
  * ext2 uses block-sized chunks. Arguably, sector-sized ones would be
  * more robust, but we have what we have
@@ -70,7 +44,7 @@ static inline unsigned ext2_chunk_size(struct inode *inode)
  * Return the offset into page `page_nr' of the last valid
  * byte in that page, plus one.
  */
-static unsigned
+unsigned
 ext2_last_byte(struct inode *inode, unsigned long page_nr)
 {
 	unsigned last_byte = inode->i_size;
@@ -81,7 +55,7 @@ ext2_last_byte(struct inode *inode, unsigned long page_nr)
 	return last_byte;
 }
 
-static void ext2_commit_chunk(struct folio *folio, loff_t pos, unsigned len)
+void ext2_commit_chunk(struct folio *folio, loff_t pos, unsigned len)
 {
 	struct address_space *mapping = folio->mapping;
 	struct inode *dir = mapping->host;
@@ -187,8 +161,8 @@ fail:
  * to folio_release_kmap() and should be treated as a call to
  * folio_release_kmap() for nesting purposes.
  */
-static void *ext2_get_folio(struct inode *dir, unsigned long n,
-				   int quiet, struct folio **foliop)
+void *ext2_get_folio(struct inode *dir, unsigned long n,
+		     int quiet, struct folio **foliop)
 {
 	struct address_space *mapping = dir->i_mapping;
 	struct folio *folio = read_mapping_folio(mapping, n, NULL);
@@ -209,30 +183,6 @@ fail:
 	return ERR_PTR(-EIO);
 }
 
-/*
- * NOTE! unlike strncmp, ext2_match returns 1 for success, 0 for failure.
- *
- * len <= EXT2_NAME_LEN and de != NULL are guaranteed by caller.
- */
-static inline int ext2_match (int len, const char * const name,
-					struct ext2_dir_entry_2 * de)
-{
-	if (len != de->name_len)
-		return 0;
-	if (!de->inode)
-		return 0;
-	return !memcmp(name, de->name, len);
-}
-
-/*
- * p is at least 6 bytes before the end of page
- */
-static inline ext2_dirent *ext2_next_entry(ext2_dirent *p)
-{
-	return (ext2_dirent *)((char *)p +
-			ext2_rec_len_from_disk(p->rec_len));
-}
-
 static inline unsigned 
 ext2_validate_entry(char *base, unsigned offset, unsigned mask)
 {
@@ -254,6 +204,55 @@ static inline void ext2_set_de_type(ext2_dirent *de, struct inode *inode)
 		de->file_type = 0;
 }
 
+/*
+ * Start readahead of directory pages from @n on, ahead of a scan that is
+ * about to map page @n.  read_mapping_folio() on its own reads a page at a
+ * time, which turns iterating over a cold directory into a long sequence
+ * of synchronous reads.  Pages are still checked one at a time, as they
+ * are first mapped.
+ */
+void ext2_dir_readahead(struct inode *dir, struct file_ra_state *ra,
+			struct file *file, unsigned long n,
+			unsigned long npages)
+{
+	struct address_space *mapping = dir->i_mapping;
+	struct folio *folio;
+
+	folio = filemap_get_folio(mapping, n);
+	if (IS_ERR(folio)) {
+		page_cache_sync_readahead(mapping, ra, file, n, npages - n);
+		return;
+	}
+	if (folio_test_readahead(folio))
+		page_cache_async_readahead(mapping, ra, file, folio, n,
+					   npages - n);
+	folio_put(folio);
+}
+
+/*
+ * Readdir is nearly always followed by a stat of what it returned.  Start
+ * reading the inode table blocks behind the entries between @de and
+ * @limit, so that those ext2_iget() calls find them in the buffer cache.
+ */
+static void ext2_readdir_inode_ra(struct super_block *sb, ext2_dirent *de,
+				  char *limit)
+{
+	unsigned long inos[32];
+	int nr = 0;
+
+	for ( ; (char *)de <= limit && de->rec_len; de = ext2_next_entry(de)) {
+		if (!de->inode)
+			continue;
+		inos[nr++] = le32_to_cpu(de->inode);
+		if (nr == ARRAY_SIZE(inos)) {
+			ext2_inode_readahead(sb, inos, nr);
+			nr = 0;
+		}
+	}
+	if (nr)
+		ext2_inode_readahead(sb, inos, nr);
+}
+
 static int
 ext2_readdir(struct file *file, struct dir_context *ctx)
 {
@@ -265,20 +264,36 @@ ext2_readdir(struct file *file, struct dir_context *ctx)
 	unsigned long npages = dir_pages(inode);
 	unsigned chunk_mask = ~(ext2_chunk_size(inode)-1);
 	bool need_revalidate = !inode_eq_iversion(inode, file->f_version);
+	unsigned long live;
 	bool has_filetype;
 
 	if (pos > inode->i_size - EXT2_DIR_REC_LEN(1))
 		return 0;
 
+	/*
+	 * A pass from position 0 to the end across which the directory does
+	 * not change counts its live entries, for ext2_empty_dir().  The count
+	 * so far is kept in private_data plus one; 0 means not counting.
+	 */
+	if (!pos) {
+		file->f_version = inode_query_iversion(inode);
+		need_revalidate = false;
+		live = 1;
+	} else {
+		live = need_revalidate ? 0 : (unsigned long)file->private_data;
+	}
+	file->private_data = NULL;
+
 	has_filetype =
 		EXT2_HAS_INCOMPAT_FEATURE(sb, EXT2_FEATURE_INCOMPAT_FILETYPE);
 
 	for ( ; n < npages; n++, offset = 0) {
 		ext2_dirent *de;
 		struct folio *folio;
-		char *kaddr = ext2_get_folio(inode, n, 0, &folio);
-		char *limit;
+		char *kaddr, *limit;
 
+		ext2_dir_readahead(inode, &file->f_ra, file, n, npages);
+		kaddr = ext2_get_folio(inode, n, 0, &folio);
 		if (IS_ERR(kaddr)) {
 			ext2_error(sb, __func__,
 				   "bad page in #%lu",
@@ -296,6 +311,9 @@ ext2_readdir(struct file *file, struct dir_context *ctx)
 		}
 		de = (ext2_dirent *)(kaddr+offset);
 		limit = kaddr + ext2_last_byte(inode, n) - EXT2_DIR_REC_LEN(1);
+		/* once per page, when it is first reached */
+		if (!offset && test_opt(sb, READDIR_RA))
+			ext2_readdir_inode_ra(sb, de, limit);
 		for ( ;(char*)de <= limit; de = ext2_next_entry(de)) {
 			if (de->rec_len == 0) {
 				ext2_error(sb, __func__,
@@ -313,16 +331,162 @@ ext2_readdir(struct file *file, struct dir_context *ctx)
 						le32_to_cpu(de->inode),
 						d_type)) {
 					folio_release_kmap(folio, de);
+					file->private_data = (void *)live;
 					return 0;
 				}
+				if (live)
+					live++;
 			}
 			ctx->pos += ext2_rec_len_from_disk(de->rec_len);
 		}
 		folio_release_kmap(folio, kaddr);
 	}
+	/* i_rwsem is held shared, so no add or delete races with this */
+	if (live)
+		WRITE_ONCE(EXT2_I(inode)->i_dir_entries, live - 1);
 	return 0;
 }
 
+/* Entries EXT2_IOC_BULKSTAT reads and stats at a time */
+#define EXT2_BULKSTAT_BATCH	64
+
+/*
+ * Copy the names of up to @nr entries of @dir from *@pos on into @ents,
+ * moving *@pos past them.  Returns the number found or a negative error.
+ */
+static int ext2_bulkstat_names(struct inode *dir, struct file *file,
+			       loff_t *pos, struct ext2_bulkstat_entry *ents,
+			       int nr)
+{
+	unsigned chunk_mask = ~(ext2_chunk_size(dir)-1);
+	unsigned long npages = dir_pages(dir);
+	unsigned long n = *pos >> PAGE_SHIFT;
+	unsigned offset = *pos & ~PAGE_MASK;
+	bool has_filetype = EXT2_HAS_INCOMPAT_FEATURE(dir->i_sb,
+					EXT2_FEATURE_INCOMPAT_FILETYPE);
+	int found = 0;
+
+	for ( ; n < npages && found < nr; n++, offset = 0) {
+		struct folio *folio;
+		char *kaddr, *limit;
+		ext2_dirent *de;
+
+		ext2_dir_readahead(dir, &file->f_ra, file, n, npages);
+		kaddr = ext2_get_folio(dir, n, 0, &folio);
+		if (IS_ERR(kaddr))
+			return found ? found : PTR_ERR(kaddr);
+		/* the position comes from user space */
+		if (offset)
+			offset = ext2_validate_entry(kaddr, offset, chunk_mask);
+		*pos = ((loff_t)n << PAGE_SHIFT) + offset;
+		de = (ext2_dirent *)(kaddr + offset);
+		limit = kaddr + ext2_last_byte(dir, n) - EXT2_DIR_REC_LEN(1);
+		for ( ; (char *)de <= limit && found < nr;
+		     de = ext2_next_entry(de)) {
+			if (de->rec_len == 0) {
+				ext2_error(dir->i_sb, __func__,
+					"zero-length directory entry");
+				folio_release_kmap(folio, de);
+				return -EIO;
+			}
+			if (de->inode && !(de->name[0] == '.' &&
+			    (de->name_len == 1 ||
+			     (de->name_len == 2 && de->name[1] == '.')))) {
+				struct ext2_bulkstat_entry *e = &ents[found++];
+
+				e->bse_ino = le32_to_cpu(de->inode);
+				e->bse_file_type = has_filetype ?
+					fs_ftype_to_dtype(de->file_type) :
+					DT_UNKNOWN;
+				e->bse_name_len = de->name_len;
+				memcpy(e->bse_name, de->name, de->name_len);
+			}
+			*pos += ext2_rec_len_from_disk(de->rec_len);
+		}
+		folio_release_kmap(folio, kaddr);
+	}
+	return found;
+}
+
+static void ext2_bulkstat_fill(struct super_block *sb,
+			       struct ext2_bulkstat_entry *e, u32 flags)
+{
+	struct inode *inode = ext2_iget(sb, e->bse_ino);
+	struct timespec64 mtime;
+
+	/* unlinked since the name was read, or bad: only the name is known */
+	if (IS_ERR(inode))
+		return;
+	mtime = inode_get_mtime(inode);
+	e->bse_mode = inode->i_mode;
+	e->bse_size = i_size_read(inode);
+	e->bse_mtime = mtime.tv_sec;
+	e->bse_mtime_nsec = mtime.tv_nsec;
+	/* the same check getxattr() makes for a user.* attribute */
+	if ((flags & EXT2_BULKSTAT_CRTIME) &&
+	    !inode_permission(&nop_mnt_idmap, inode, MAY_READ))
+		e->bse_crtime = ext2_creation_time(inode);
+	iput(inode);
+}
+
+/*
+ * EXT2_IOC_BULKSTAT.  Names are read a batch at a time under the directory
+ * lock, the inode table blocks behind the whole batch are read ahead in
+ * disk order, and only then are the inodes looked up one by one, mostly
+ * from the buffer cache.
+ */
+int ext2_bulkstat(struct file *file, struct ext2_bulkstat *bs)
+{
+	struct inode *dir = file_inode(file);
+	struct ext2_bulkstat_entry __user *ubuf = u64_to_user_ptr(bs->bs_buf);
+	struct ext2_bulkstat_entry *ents;
+	unsigned long *blocks;
+	loff_t pos = bs->bs_pos;
+	u32 done = 0;
+	int nr, i, err = 0;
+
+	ents = kvmalloc_array(EXT2_BULKSTAT_BATCH, sizeof(*ents), GFP_KERNEL);
+	blocks = kmalloc_array(EXT2_BULKSTAT_BATCH, sizeof(*blocks),
+			       GFP_KERNEL);
+	if (!ents || !blocks) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	while (done < bs->bs_count) {
+		nr = min_t(u32, bs->bs_count - done, EXT2_BULKSTAT_BATCH);
+		memset(ents, 0, nr * sizeof(*ents));
+		inode_lock_shared(dir);
+		nr = ext2_bulkstat_names(dir, file, &pos, ents, nr);
+		inode_unlock_shared(dir);
+		if (nr <= 0) {
+			err = nr;
+			break;
+		}
+
+		for (i = 0; i < nr; i++)
+			blocks[i] = ents[i].bse_ino;
+		ext2_inode_readahead(dir->i_sb, blocks, nr);
+		for (i = 0; i < nr; i++)
+			ext2_bulkstat_fill(dir->i_sb, &ents[i], bs->bs_flags);
+
+		if (copy_to_user(ubuf + done, ents, nr * sizeof(*ents))) {
+			err = -EFAULT;
+			break;
+		}
+		done += nr;
+		bs->bs_pos = pos;
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+	bs->bs_count = done;
+out:
+	kfree(blocks);
+	kvfree(ents);
+	return done ? 0 : err;
+}
+
 /*
  *	ext2_find_entry()
  *
@@ -349,17 +513,42 @@ struct ext2_dir_entry_2 *ext2_find_entry (struct inode *dir,
 	unsigned long start, n;
 	unsigned long npages = dir_pages(dir);
 	struct ext2_inode_info *ei = EXT2_I(dir);
+	struct ext2_match_key key;
+	struct file_ra_state ra;
 	ext2_dirent * de;
 
 	if (npages == 0)
 		goto out;
 
+	/*
+	 * "." and ".." live in the index root and are never hashed, so
+	 * they are always found by the linear scan of the first block.
+	 */
+	if (ext2_dx_indexed(dir) &&
+	    !(namelen <= 2 && name[0] == '.' &&
+	      (namelen == 1 || name[1] == '.'))) {
+		de = ext2_dx_find_entry(dir, child, foliop);
+		if (!IS_ERR(de) || PTR_ERR(de) != -EFSCORRUPTED)
+			return de;
+		/* bad index: fall back to the linear scan */
+	} else if (test_opt(dir->i_sb, DIRCACHE) && !ext2_dx_indexed(dir)) {
+		de = ext2_dir_cache_find(dir, child, foliop);
+		if (!IS_ERR(de) || PTR_ERR(de) != -EAGAIN)
+			return de;
+	}
+
 	start = ei->i_dir_start_lookup;
 	if (start >= npages)
 		start = 0;
 	n = start;
+	ext2_match_key_init(&key, name, namelen);
+	file_ra_state_init(&ra, dir->i_mapping);
 	do {
-		char *kaddr = ext2_get_folio(dir, n, 0, foliop);
+		char *kaddr;
+
+		if (npages > 1)
+			ext2_dir_readahead(dir, &ra, NULL, n, npages);
+		kaddr = ext2_get_folio(dir, n, 0, foliop);
 		if (IS_ERR(kaddr))
 			return ERR_CAST(kaddr);
 
@@ -372,7 +561,7 @@ struct ext2_dir_entry_2 *ext2_find_entry (struct inode *dir,
 				folio_release_kmap(*foliop, de);
 				goto out;
 			}
-			if (ext2_match(namelen, name, de))
+			if (ext2_match_key(&key, de))
 				goto found;
 			de = ext2_next_entry(de);
 		}
@@ -433,7 +622,7 @@ int ext2_inode_by_name(struct inode *dir, const struct qstr *child, ino_t *ino)
 	return 0;
 }
 
-static int ext2_prepare_chunk(struct folio *folio, loff_t pos, unsigned len)
+int ext2_prepare_chunk(struct folio *folio, loff_t pos, unsigned len)
 {
 	return __block_write_begin(&folio->page, pos, len, ext2_get_block);
 }
@@ -466,11 +655,134 @@ int ext2_set_link(struct inode *dir, struct ext2_dir_entry_2 *de,
 	ext2_commit_chunk(folio, pos, len);
 	if (update_times)
 		inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
-	EXT2_I(dir)->i_flags &= ~EXT2_BTREE_FL;
 	mark_inode_dirty(dir);
 	return ext2_handle_dirsync(dir);
 }
 
+/*
+ * Store the entry for @name at @de, which has enough room for it, splitting
+ * off the unused tail of a live entry first.  The folio must be locked; it
+ * is unlocked on return.
+ */
+int ext2_insert_entry(struct inode *dir, struct folio *folio,
+		ext2_dirent *de, const struct qstr *name, struct inode *inode)
+{
+	unsigned short rec_len = ext2_rec_len_from_disk(de->rec_len);
+	unsigned short name_len = 0;
+	loff_t pos = folio_pos(folio) + offset_in_folio(folio, de);
+	int err;
+
+	if (de->inode)
+		name_len = EXT2_DIR_REC_LEN(de->name_len);
+	err = ext2_prepare_chunk(folio, pos, rec_len);
+	if (err) {
+		folio_unlock(folio);
+		return err;
+	}
+	if (de->inode) {
+		ext2_dirent *de1 = (ext2_dirent *) ((char *) de + name_len);
+		de1->rec_len = ext2_rec_len_to_disk(rec_len - name_len);
+		de->rec_len = ext2_rec_len_to_disk(name_len);
+		de = de1;
+	}
+	de->name_len = name->len;
+	memcpy(de->name, name->name, name->len);
+	de->inode = cpu_to_le32(inode->i_ino);
+	ext2_set_de_type (de, inode);
+	ext2_dir_cache_add(dir, name->name, name->len,
+			   folio_pos(folio) + offset_in_folio(folio, de));
+	if (EXT2_I(dir)->i_dir_entries >= 0)
+		EXT2_I(dir)->i_dir_entries++;
+	ext2_commit_chunk(folio, pos, rec_len);
+	inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+	mark_inode_dirty(dir);
+	return ext2_handle_dirsync(dir);
+}
+
+/*
+ * Remember that @dentry was just looked up and found absent.  If the same
+ * dentry is then added before the directory changes (lookup and create
+ * under one i_rwsem hold), ext2_add_link() need not look for a duplicate.
+ */
+void ext2_note_negative(struct inode *dir, struct dentry *dentry)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+
+	spin_lock(&ei->i_dir_cache_lock);
+	ei->i_neg_dentry = dentry;
+	ei->i_neg_hash_len = dentry->d_name.hash_len;
+	ei->i_neg_version = inode_query_iversion(dir);
+	spin_unlock(&ei->i_dir_cache_lock);
+}
+
+static bool ext2_known_negative(struct inode *dir, struct dentry *dentry)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	bool ret;
+
+	spin_lock(&ei->i_dir_cache_lock);
+	ret = ei->i_neg_dentry == dentry &&
+	      ei->i_neg_hash_len == dentry->d_name.hash_len &&
+	      inode_eq_iversion(dir, ei->i_neg_version);
+	ei->i_neg_dentry = NULL;
+	spin_unlock(&ei->i_dir_cache_lock);
+	return ret;
+}
+
+/*
+ * Return the free slot map of @dir, sized for @npages pages plus the one an
+ * insert may add.  New slots start out unknown.  NULL if it can't be had.
+ */
+static u16 *ext2_dir_gaps(struct inode *dir, unsigned long npages)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	unsigned long nr = npages + 1;
+	u16 *gaps;
+
+	if (ei->i_dir_gaps_nr >= nr)
+		return ei->i_dir_gaps;
+	nr = roundup_pow_of_two(nr);
+	gaps = krealloc_array(ei->i_dir_gaps, nr, sizeof(*gaps), GFP_KERNEL);
+	if (!gaps)
+		return NULL;
+	memset(gaps + ei->i_dir_gaps_nr, 0xff,
+	       (nr - ei->i_dir_gaps_nr) * sizeof(*gaps));
+	ei->i_dir_gaps = gaps;
+	ei->i_dir_gaps_nr = nr;
+	return gaps;
+}
+
+static void ext2_set_gap(u16 *gaps, unsigned long n, unsigned gap)
+{
+	gaps[n] = min_t(unsigned, gap, EXT2_GAP_UNKNOWN - 1);
+}
+
+/* Largest slot a new entry could use between @kaddr and @end. */
+static unsigned ext2_page_gap(char *kaddr, char *end)
+{
+	ext2_dirent *de = (ext2_dirent *)kaddr;
+	unsigned gap = 0;
+
+	while ((char *)de < end && de->rec_len) {
+		unsigned rec_len = ext2_rec_len_from_disk(de->rec_len);
+
+		if (de->inode)
+			rec_len -= EXT2_DIR_REC_LEN(de->name_len);
+		gap = max(gap, rec_len);
+		de = ext2_next_entry(de);
+	}
+	return gap;
+}
+
+void ext2_dir_gaps_drop(struct inode *dir)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+
+	kfree(ei->i_dir_gaps);
+	ei->i_dir_gaps = NULL;
+	ei->i_dir_gaps_nr = 0;
+}
+
 /*
  *	Parent is locked.
  */
@@ -486,18 +798,42 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 	ext2_dirent * de;
 	unsigned long npages = dir_pages(dir);
 	unsigned long n;
-	loff_t pos;
+	bool absent = ext2_known_negative(dir, dentry);
+	struct ext2_match_key key;
+	u16 *gaps = NULL;
 	int err;
 
+	if (ext2_dx_indexed(dir)) {
+		err = ext2_dx_add_link(dentry, inode);
+		if (err != -EFSCORRUPTED)
+			return err;
+		/*
+		 * The index is unusable; drop it and treat the directory as
+		 * the linear one it still is underneath.
+		 */
+		EXT2_I(dir)->i_flags &= ~EXT2_INDEX_FL;
+		mark_inode_dirty(dir);
+	}
+	if (npages > 1)
+		gaps = ext2_dir_gaps(dir, npages);
+	ext2_match_key_init(&key, name, namelen);
+
 	/*
 	 * We take care of directory expansion in the same loop.
 	 * This code plays outside i_size, so it locks the folio
 	 * to protect that region.
+	 *
+	 * Full pages known to be too tight for this name are skipped
+	 * without reading them, but only when we also know there is no
+	 * duplicate to find in them.
 	 */
 	for (n = 0; n <= npages; n++) {
-		char *kaddr = ext2_get_folio(dir, n, 0, &folio);
-		char *dir_end;
+		char *kaddr, *dir_end;
 
+		if (absent && gaps && n < npages && gaps[n] < reclen &&
+		    ext2_last_byte(dir, n) == PAGE_SIZE)
+			continue;
+		kaddr = ext2_get_folio(dir, n, 0, &folio);
 		if (IS_ERR(kaddr))
 			return PTR_ERR(kaddr);
 		folio_lock(folio);
@@ -506,6 +842,17 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 		kaddr += folio_size(folio) - reclen;
 		while ((char *)de <= kaddr) {
 			if ((char *)de == dir_end) {
+				/*
+				 * A full single-block directory is indexed
+				 * rather than grown linearly.
+				 */
+				if (dir->i_size == chunk_size &&
+				    ext2_dx_enabled(dir)) {
+					folio_unlock(folio);
+					folio_release_kmap(folio, kaddr);
+					return ext2_dx_make_indexed(dentry,
+								    inode);
+				}
 				/* We hit i_size */
 				name_len = 0;
 				rec_len = chunk_size;
@@ -520,7 +867,7 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 				goto out_unlock;
 			}
 			err = -EEXIST;
-			if (ext2_match (namelen, name, de))
+			if (ext2_match_key(&key, de))
 				goto out_unlock;
 			name_len = EXT2_DIR_REC_LEN(de->name_len);
 			rec_len = ext2_rec_len_from_disk(de->rec_len);
@@ -530,6 +877,9 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 				goto got_it;
 			de = (ext2_dirent *) ((char *) de + rec_len);
 		}
+		if (gaps)
+			ext2_set_gap(gaps, n, ext2_page_gap(dir_end -
+					ext2_last_byte(dir, n), dir_end));
 		folio_unlock(folio);
 		folio_release_kmap(folio, kaddr);
 	}
@@ -537,25 +887,10 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 	return -EINVAL;
 
 got_it:
-	pos = folio_pos(folio) + offset_in_folio(folio, de);
-	err = ext2_prepare_chunk(folio, pos, rec_len);
-	if (err)
-		goto out_unlock;
-	if (de->inode) {
-		ext2_dirent *de1 = (ext2_dirent *) ((char *) de + name_len);
-		de1->rec_len = ext2_rec_len_to_disk(rec_len - name_len);
-		de->rec_len = ext2_rec_len_to_disk(name_len);
-		de = de1;
-	}
-	de->name_len = namelen;
-	memcpy(de->name, name, namelen);
-	de->inode = cpu_to_le32(inode->i_ino);
-	ext2_set_de_type (de, inode);
-	ext2_commit_chunk(folio, pos, rec_len);
-	inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+	if (gaps)
+		gaps[n] = EXT2_GAP_UNKNOWN;
 	EXT2_I(dir)->i_flags &= ~EXT2_BTREE_FL;
-	mark_inode_dirty(dir);
-	err = ext2_handle_dirsync(dir);
+	err = ext2_insert_entry(dir, folio, de, &dentry->d_name, inode);
 	/* OFFSET_CACHE */
 out_put:
 	folio_release_kmap(folio, de);
@@ -565,6 +900,8 @@ out_unlock:
 	goto out_put;
 }
 
+static void ext2_compact_queue(struct inode *dir);
+
 /*
  * ext2_delete_entry deletes a directory entry by merging it with the
  * previous entry. Page is up-to-date.
@@ -604,10 +941,27 @@ int ext2_delete_entry(struct ext2_dir_entry_2 *dir, struct folio *folio)
 	}
 	if (pde)
 		pde->rec_len = ext2_rec_len_to_disk(to - from);
+	ext2_dir_cache_del(inode, dir->name, dir->name_len,
+			   folio_pos(folio) + offset_in_folio(folio, dir));
+	if (EXT2_I(inode)->i_dir_entries > 0)
+		EXT2_I(inode)->i_dir_entries--;
 	dir->inode = 0;
+	if (folio->index < EXT2_I(inode)->i_dir_gaps_nr &&
+	    EXT2_I(inode)->i_dir_gaps[folio->index] != EXT2_GAP_UNKNOWN) {
+		unsigned gap = to - from;
+
+		if (pde && pde->inode)
+			gap -= EXT2_DIR_REC_LEN(pde->name_len);
+		if (gap > EXT2_I(inode)->i_dir_gaps[folio->index])
+			ext2_set_gap(EXT2_I(inode)->i_dir_gaps, folio->index,
+				     gap);
+	}
 	ext2_commit_chunk(folio, pos, to - from);
+	/* the whole block is free now */
+	if ((!pde || !pde->inode) && to - from == ext2_chunk_size(inode) &&
+	    test_opt(inode->i_sb, AUTOCOMPACT))
+		ext2_compact_queue(inode);
 	inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
-	EXT2_I(inode)->i_flags &= ~EXT2_BTREE_FL;
 	mark_inode_dirty(inode);
 	return ext2_handle_dirsync(inode);
 }
@@ -648,6 +1002,7 @@ int ext2_make_empty(struct inode *inode, struct inode *parent)
 	ext2_set_de_type (de, inode);
 	kunmap_local(kaddr);
 	ext2_commit_chunk(folio, 0, chunk_size);
+	EXT2_I(inode)->i_dir_entries = 2;
 	err = ext2_handle_dirsync(inode);
 fail:
 	folio_put(folio);
@@ -656,16 +1011,29 @@ fail:
 
 /*
  * routine to check that the specified directory is empty (for rmdir)
+ *
+ * Once the number of live entries is known this needs no I/O, however
+ * large the directory once grew.  A readdir of the whole directory, such
+ * as the one rm -rf does before it unlinks, establishes the count, and so
+ * does the scan here that proves a directory empty.
  */
 int ext2_empty_dir(struct inode *inode)
 {
 	struct folio *folio;
+	struct file_ra_state ra;
 	char *kaddr;
 	unsigned long i, npages = dir_pages(inode);
+	long live = 0;
+
+	if (EXT2_I(inode)->i_dir_entries >= 0)
+		return EXT2_I(inode)->i_dir_entries <= 2;
 
+	file_ra_state_init(&ra, inode->i_mapping);
 	for (i = 0; i < npages; i++) {
 		ext2_dirent *de;
 
+		if (npages > 1)
+			ext2_dir_readahead(inode, &ra, NULL, i, npages);
 		kaddr = ext2_get_folio(inode, i, 0, &folio);
 		if (IS_ERR(kaddr))
 			return 0;
@@ -692,11 +1060,13 @@ int ext2_empty_dir(struct inode *inode)
 						goto not_empty;
 				} else if (de->name[1] != '.')
 					goto not_empty;
+				live++;
 			}
 			de = ext2_next_entry(de);
 		}
 		folio_release_kmap(folio, kaddr);
 	}
+	EXT2_I(inode)->i_dir_entries = live;
 	return 1;
 
 not_empty:
@@ -704,7 +1074,335 @@ not_empty:
 	return 0;
 }
 
+/*
+ * Directory compaction.
+ *
+ * Unlink only merges a dead entry into the one before it, so a directory
+ * never gets any smaller.  Compaction moves the live entries of the last
+ * blocks into free slots of earlier ones, working back from the end until
+ * an entry finds no room, and then cuts off the blocks it emptied.
+ *
+ * Every change goes through ext2_commit_chunk() and so bumps i_version.  A
+ * readdir resuming at an old position revalidates it with
+ * ext2_validate_entry(), and one past the new end just finishes.  But an
+ * entry moved behind a reader's position would not be returned to it, and
+ * an rm -rf racing with compaction would then find the directory not
+ * empty.  So entries are only moved while nobody else has the directory
+ * open; otherwise compaction just cuts off the empty blocks at the end.
+ * A file opened meanwhile is at position 0 until it can read, which is
+ * after compaction drops i_rwsem.
+ */
+
+/* Delay before a directory that lost a block to unlink is compacted. */
+#define EXT2_COMPACT_DELAY	(30 * HZ)
+
+/*
+ * Copy the live entry @de into a free slot of block @blk.  -ENOSPC if the
+ * block turns out to be too full after all.
+ */
+static int ext2_compact_copy(struct inode *dir, ext2_dirent *de,
+			     unsigned long blk, u16 *gaps)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	unsigned reclen = EXT2_DIR_REC_LEN(de->name_len);
+	loff_t start = (loff_t)blk << dir->i_blkbits;
+	unsigned short rec_len, name_len = 0;
+	struct folio *folio;
+	char *kaddr, *end;
+	ext2_dirent *p;
+	loff_t pos;
+	int err = -ENOSPC;
+
+	kaddr = ext2_get_folio(dir, start >> PAGE_SHIFT, 0, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	p = (ext2_dirent *)(kaddr + offset_in_page(start));
+	end = (char *)p + chunk_size;
+	for (; (char *)p < end; p = ext2_next_entry(p)) {
+		rec_len = ext2_rec_len_from_disk(p->rec_len);
+		name_len = p->inode ? EXT2_DIR_REC_LEN(p->name_len) : 0;
+		if (rec_len >= name_len + reclen)
+			break;
+	}
+	if ((char *)p >= end)
+		goto out;
+
+	pos = folio_pos(folio) + offset_in_folio(folio, p);
+	folio_lock(folio);
+	err = ext2_prepare_chunk(folio, pos, rec_len);
+	if (err) {
+		folio_unlock(folio);
+		goto out;
+	}
+	if (p->inode) {
+		ext2_dirent *p1 = (ext2_dirent *)((char *)p + name_len);
+
+		p1->rec_len = ext2_rec_len_to_disk(rec_len - name_len);
+		p->rec_len = ext2_rec_len_to_disk(name_len);
+		p = p1;
+	}
+	p->inode = de->inode;
+	p->name_len = de->name_len;
+	p->file_type = de->file_type;
+	memcpy(p->name, de->name, de->name_len);
+	ext2_commit_chunk(folio, pos, rec_len);
+out:
+	ext2_set_gap(gaps, blk, ext2_page_gap(end - chunk_size, end));
+	folio_release_kmap(folio, kaddr);
+	return err;
+}
+
+/*
+ * Move the live entries of block @blk into blocks before it.  Returns 1 if
+ * the block was emptied, 0 if an entry found no room, or a negative error.
+ * Blocks below *@first are known to have no room for any entry.
+ */
+static int ext2_compact_block(struct inode *dir, unsigned long blk,
+			      u16 *gaps, unsigned long *first)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	loff_t start = (loff_t)blk << dir->i_blkbits;
+	struct folio *folio;
+	ext2_dirent *de, *p;
+	char *kaddr, *end;
+	unsigned long t;
+	int moved = 0;
+	int ret = 1, err;
+
+	kaddr = ext2_get_folio(dir, start >> PAGE_SHIFT, 0, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	de = (ext2_dirent *)(kaddr + offset_in_page(start));
+	end = (char *)de + chunk_size;
+
+	for (p = de; (char *)p < end; p = ext2_next_entry(p)) {
+		unsigned reclen = EXT2_DIR_REC_LEN(p->name_len);
+
+		if (!p->inode)
+			continue;
+		while (*first < blk && gaps[*first] < EXT2_DIR_REC_LEN(1))
+			(*first)++;
+		err = -ENOSPC;
+		for (t = *first; t < blk && err == -ENOSPC; t++)
+			if (gaps[t] >= reclen)
+				err = ext2_compact_copy(dir, p, t, gaps);
+		if (err) {
+			ret = err == -ENOSPC ? 0 : err;
+			break;
+		}
+		moved++;
+	}
+	if (!moved)
+		goto out;
+
+	/*
+	 * The copies go to disk before the originals are dropped, so that a
+	 * crash in between leaves duplicate names for e2fsck rather than
+	 * lost ones.
+	 */
+	err = filemap_write_and_wait(dir->i_mapping);
+	if (err && ret >= 0)
+		ret = err;
+
+	folio_lock(folio);
+	err = ext2_prepare_chunk(folio, start, chunk_size);
+	if (err) {
+		folio_unlock(folio);
+		ret = err;
+		goto out;
+	}
+	for (p = de; moved && (char *)p < end; p = ext2_next_entry(p)) {
+		if (p->inode) {
+			p->inode = 0;
+			moved--;
+		}
+	}
+	/* fold every dead entry into the one before it */
+	for (p = de; (char *)ext2_next_entry(p) < end; ) {
+		ext2_dirent *next = ext2_next_entry(p);
+
+		if (next->inode) {
+			p = next;
+			continue;
+		}
+		p->rec_len = ext2_rec_len_to_disk(
+				ext2_rec_len_from_disk(p->rec_len) +
+				ext2_rec_len_from_disk(next->rec_len));
+	}
+	ext2_commit_chunk(folio, start, chunk_size);
+	ext2_set_gap(gaps, blk, ext2_page_gap((char *)de, end));
+out:
+	folio_release_kmap(folio, kaddr);
+	return ret;
+}
+
+/*
+ * Repack the entries of @dir into as few blocks as they fit in and give
+ * back the blocks emptied at the end.  @file is the caller's own open file
+ * of @dir, if any.  The caller holds the directory's i_rwsem exclusively.
+ */
+int ext2_compact_dir(struct inode *dir, struct file *file)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	unsigned long nblocks = dir->i_size >> dir->i_blkbits;
+	unsigned long npages = dir_pages(dir);
+	unsigned long n, blk = 0, first = 0;
+	struct file_ra_state ra;
+	loff_t size;
+	bool readers;
+	u16 *gaps;
+	int ret = 0;
+
+	if (nblocks <= 1)
+		return 0;
+	/*
+	 * Entries would change blocks under the index, and nothing builds an
+	 * index again for a directory of more than one block.
+	 */
+	if (ext2_dx_indexed(dir))
+		return -EOPNOTSUPP;
+	readers = atomic_read(&EXT2_I(dir)->i_dir_openers) > (file ? 1 : 0);
+	gaps = kvmalloc_array(nblocks, sizeof(*gaps), GFP_KERNEL);
+	if (!gaps)
+		return -ENOMEM;
+
+	/* entries change blocks, which the caches do not survive */
+	ext2_dir_cache_drop(dir);
+	ext2_dir_gaps_drop(dir);
+
+	file_ra_state_init(&ra, dir->i_mapping);
+	for (n = 0; n < npages; n++) {
+		struct folio *folio;
+		char *kaddr, *p, *end;
+
+		ext2_dir_readahead(dir, &ra, NULL, n, npages);
+		kaddr = ext2_get_folio(dir, n, 0, &folio);
+		if (IS_ERR(kaddr)) {
+			ret = PTR_ERR(kaddr);
+			goto out;
+		}
+		end = kaddr + ext2_last_byte(dir, n);
+		for (p = kaddr; p < end; p += chunk_size)
+			ext2_set_gap(gaps, blk++,
+				     ext2_page_gap(p, p + chunk_size));
+		folio_release_kmap(folio, kaddr);
+	}
+
+	for (blk = nblocks - 1; blk > 0; blk--) {
+		if (readers) {
+			if (gaps[blk] < chunk_size)
+				break;
+			continue;
+		}
+		ret = ext2_compact_block(dir, blk, gaps, &first);
+		if (ret <= 0)
+			break;
+		ret = 0;
+		cond_resched();
+	}
+
+	/* blk is the last block still in use */
+	size = (loff_t)(blk + 1) << dir->i_blkbits;
+	if (size < dir->i_size) {
+		ext2_shrink_blocks(dir, size);
+		inode_inc_iversion(dir);
+	}
+	if (!ret && IS_DIRSYNC(dir))
+		ret = ext2_handle_dirsync(dir);
+out:
+	kvfree(gaps);
+	return ret;
+}
+
+static void ext2_compact_queue(struct inode *dir)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	struct ext2_inode_info *ei = EXT2_I(dir);
+
+	if (dir->i_size <= ext2_chunk_size(dir) || ext2_dx_indexed(dir) ||
+	    !list_empty_careful(&ei->i_compact))
+		return;
+	spin_lock(&sbi->s_compact_lock);
+	if (list_empty(&ei->i_compact))
+		list_add_tail(&ei->i_compact, &sbi->s_compact_list);
+	spin_unlock(&sbi->s_compact_lock);
+	queue_delayed_work(system_unbound_wq, &sbi->s_compact_work,
+			   EXT2_COMPACT_DELAY);
+}
+
+void ext2_compact_del(struct inode *dir)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+
+	if (list_empty_careful(&EXT2_I(dir)->i_compact))
+		return;
+	spin_lock(&sbi->s_compact_lock);
+	list_del_init(&EXT2_I(dir)->i_compact);
+	spin_unlock(&sbi->s_compact_lock);
+}
+
+void ext2_compact_work(struct work_struct *work)
+{
+	struct ext2_sb_info *sbi = container_of(to_delayed_work(work),
+					struct ext2_sb_info, s_compact_work);
+	struct super_block *sb = sbi->s_sb;
+	struct ext2_inode_info *ei;
+	struct inode *dir;
+
+	/* a frozen fs is picked up again by ext2_unfreeze() */
+	if (!sb_start_intwrite_trylock(sb))
+		return;
+	spin_lock(&sbi->s_compact_lock);
+	ei = list_first_entry_or_null(&sbi->s_compact_list,
+				      struct ext2_inode_info, i_compact);
+	if (!ei) {
+		spin_unlock(&sbi->s_compact_lock);
+		sb_end_intwrite(sb);
+		return;
+	}
+	list_del_init(&ei->i_compact);
+	dir = &ei->vfs_inode;
+	/* as in ext2_orphan_work(), RCU holds off the free */
+	rcu_read_lock();
+	spin_unlock(&sbi->s_compact_lock);
+	spin_lock(&dir->i_lock);
+	if (dir->i_state & (I_FREEING | I_WILL_FREE)) {
+		spin_unlock(&dir->i_lock);
+		rcu_read_unlock();
+		sb_end_intwrite(sb);
+		goto next;
+	}
+	__iget(dir);
+	spin_unlock(&dir->i_lock);
+	rcu_read_unlock();
+
+	inode_lock(dir);
+	if (!IS_DEADDIR(dir) && !sb_rdonly(sb))
+		ext2_compact_dir(dir, NULL);
+	inode_unlock(dir);
+	sb_end_intwrite(sb);
+	iput(dir);
+next:
+	/* one directory a run, so that cancelling waits for one at most */
+	if (!list_empty_careful(&sbi->s_compact_list))
+		queue_delayed_work(system_unbound_wq, &sbi->s_compact_work, 0);
+}
+
+static int ext2_dir_open(struct inode *inode, struct file *file)
+{
+	atomic_inc(&EXT2_I(inode)->i_dir_openers);
+	return 0;
+}
+
+static int ext2_dir_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&EXT2_I(inode)->i_dir_openers);
+	return 0;
+}
+
 const struct file_operations ext2_dir_operations = {
+	.open		= ext2_dir_open,
+	.release	= ext2_dir_release,
 	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
 	.iterate_shared	= ext2_readdir,
@@ -0,0 +1,368 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/ext2/dir_cache.c
+ *
+ * In-memory name hash for linear directories (-o dircache).
+ *
+ * The first lookup in a directory scans it once and records the offset of
+ * every live entry, keyed by a hash of its name.  From then on lookups only
+ * look at the entries whose hash matches, and a miss needs no directory I/O
+ * at all, since the table is kept complete by ext2_insert_entry() and
+ * ext2_delete_entry().  Entries in a linear directory never move, and
+ * ext2_set_link() changes neither name nor offset, so nothing else has to
+ * know about the table.  Indexed directories have no table: they already
+ * find names by hash on disk, and converting a directory to an index drops
+ * its table.
+ *
+ * The tables are on a global LRU and are freed whole by a shrinker.
+ *
+ * Locking: the table of a directory is created and modified with the
+ * directory's i_rwsem held, but lookups only hold it shared, so
+ * i_dir_cache_lock protects the table and the inode's pointer to it.
+ * ext2_dir_cache_lock protects the LRU and nests inside it.
+ */
+
+#include "ext2.h"
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/stringhash.h>
+
+typedef struct ext2_dir_entry_2 ext2_dirent;
+
+struct ext2_dir_cache_entry {
+	struct hlist_node	node;
+	u32			hash;
+	u32			pos;		/* offset of the entry in the dir */
+};
+
+struct ext2_dir_cache {
+	struct list_head	lru;
+	struct ext2_inode_info	*ei;
+	unsigned long		nr;		/* entries in the table */
+	bool			referenced;	/* used since the last scan */
+	unsigned		bits;
+	struct hlist_head	buckets[];
+};
+
+/* Candidates checked per lookup before giving up and scanning. */
+#define EXT2_DIR_CACHE_PROBE	8
+
+static struct kmem_cache *ext2_dir_cache_cachep;
+static struct shrinker *ext2_dir_cache_shrinker;
+static LIST_HEAD(ext2_dir_cache_lru);
+static DEFINE_SPINLOCK(ext2_dir_cache_lock);
+static atomic_long_t ext2_dir_cache_nr;
+
+static inline u32 ext2_dir_cache_hash(const char *name, int len)
+{
+	return full_name_hash(NULL, name, len);
+}
+
+static inline struct hlist_head *
+ext2_dir_cache_bucket(struct ext2_dir_cache *dc, u32 hash)
+{
+	return &dc->buckets[hash_32(hash, dc->bits)];
+}
+
+static void ext2_dir_cache_free(struct ext2_dir_cache *dc)
+{
+	struct ext2_dir_cache_entry *e;
+	struct hlist_node *tmp;
+	unsigned i;
+
+	for (i = 0; i < (1U << dc->bits); i++)
+		hlist_for_each_entry_safe(e, tmp, &dc->buckets[i], node)
+			kmem_cache_free(ext2_dir_cache_cachep, e);
+	kvfree(dc);
+}
+
+/*
+ * Detach the table from its inode and the LRU.  Called with
+ * i_dir_cache_lock held; the caller frees the table.
+ */
+static void ext2_dir_cache_unlink(struct ext2_dir_cache *dc)
+{
+	spin_lock(&ext2_dir_cache_lock);
+	list_del(&dc->lru);
+	spin_unlock(&ext2_dir_cache_lock);
+	atomic_long_sub(dc->nr, &ext2_dir_cache_nr);
+	dc->ei->i_dir_cache = NULL;
+}
+
+void ext2_dir_cache_drop(struct inode *dir)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	struct ext2_dir_cache *dc;
+
+	if (!READ_ONCE(ei->i_dir_cache))
+		return;
+	spin_lock(&ei->i_dir_cache_lock);
+	dc = ei->i_dir_cache;
+	if (dc)
+		ext2_dir_cache_unlink(dc);
+	spin_unlock(&ei->i_dir_cache_lock);
+	if (dc)
+		ext2_dir_cache_free(dc);
+}
+
+static int ext2_dir_cache_insert(struct ext2_dir_cache *dc, u32 hash,
+				 loff_t pos, gfp_t gfp)
+{
+	struct ext2_dir_cache_entry *e;
+
+	e = kmem_cache_alloc(ext2_dir_cache_cachep, gfp);
+	if (!e)
+		return -ENOMEM;
+	e->hash = hash;
+	e->pos = pos;
+	hlist_add_head(&e->node, ext2_dir_cache_bucket(dc, hash));
+	dc->nr++;
+	return 0;
+}
+
+/*
+ * Build the table for @dir with a full scan.  The directory cannot change
+ * under us, since the caller holds i_rwsem at least shared.
+ */
+static struct ext2_dir_cache *ext2_dir_cache_build(struct inode *dir)
+{
+	unsigned long npages = dir_pages(dir);
+	struct ext2_dir_cache *dc;
+	struct file_ra_state ra;
+	unsigned long n;
+	unsigned bits;
+
+	bits = clamp_t(unsigned, ilog2(dir->i_size >> 5), 4, 12);
+	dc = kvzalloc(struct_size(dc, buckets, 1U << bits), GFP_KERNEL);
+	if (!dc)
+		return NULL;
+	dc->bits = bits;
+	dc->ei = EXT2_I(dir);
+
+	file_ra_state_init(&ra, dir->i_mapping);
+	for (n = 0; n < npages; n++) {
+		struct folio *folio;
+		char *kaddr, *limit;
+		ext2_dirent *de;
+
+		ext2_dir_readahead(dir, &ra, NULL, n, npages);
+		kaddr = ext2_get_folio(dir, n, 0, &folio);
+		if (IS_ERR(kaddr))
+			goto fail;
+		de = (ext2_dirent *)kaddr;
+		limit = kaddr + ext2_last_byte(dir, n) - EXT2_DIR_REC_LEN(1);
+		for ( ; (char *)de <= limit; de = ext2_next_entry(de)) {
+			loff_t pos = folio_pos(folio) +
+				     offset_in_folio(folio, de);
+
+			if (!de->inode)
+				continue;
+			if (ext2_dir_cache_insert(dc,
+				ext2_dir_cache_hash(de->name, de->name_len),
+				pos, GFP_KERNEL)) {
+				folio_release_kmap(folio, kaddr);
+				goto fail;
+			}
+		}
+		folio_release_kmap(folio, kaddr);
+	}
+	/* A full scan is as good a time as any to learn the entry count. */
+	WRITE_ONCE(EXT2_I(dir)->i_dir_entries, dc->nr);
+	return dc;
+fail:
+	ext2_dir_cache_free(dc);
+	return NULL;
+}
+
+/*
+ * Look @child up through the table, building it first if needed.  Returns
+ * the entry as ext2_find_entry() does, -ENOENT for a miss, or -EAGAIN if
+ * the caller should fall back to scanning the directory.
+ */
+struct ext2_dir_entry_2 *ext2_dir_cache_find(struct inode *dir,
+			const struct qstr *child, struct folio **foliop)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	u32 hash = ext2_dir_cache_hash(child->name, child->len);
+	u32 pos[EXT2_DIR_CACHE_PROBE];
+	struct ext2_dir_cache_entry *e;
+	struct ext2_dir_cache *dc, *new = NULL;
+	int i, nr = 0;
+
+	spin_lock(&ei->i_dir_cache_lock);
+	while (!ei->i_dir_cache) {
+		spin_unlock(&ei->i_dir_cache_lock);
+		if (new)
+			ext2_dir_cache_free(new);
+		new = ext2_dir_cache_build(dir);
+		if (!new)
+			return ERR_PTR(-EAGAIN);
+		spin_lock(&ei->i_dir_cache_lock);
+		if (ei->i_dir_cache)
+			break;
+		ei->i_dir_cache = new;
+		spin_lock(&ext2_dir_cache_lock);
+		list_add(&new->lru, &ext2_dir_cache_lru);
+		spin_unlock(&ext2_dir_cache_lock);
+		atomic_long_add(new->nr, &ext2_dir_cache_nr);
+		new = NULL;
+	}
+	dc = ei->i_dir_cache;
+	WRITE_ONCE(dc->referenced, true);
+	hlist_for_each_entry(e, ext2_dir_cache_bucket(dc, hash), node) {
+		if (e->hash != hash)
+			continue;
+		if (nr == EXT2_DIR_CACHE_PROBE) {
+			nr = -1;
+			break;
+		}
+		pos[nr++] = e->pos;
+	}
+	spin_unlock(&ei->i_dir_cache_lock);
+	if (new)
+		ext2_dir_cache_free(new);
+	if (nr < 0)
+		return ERR_PTR(-EAGAIN);
+
+	for (i = 0; i < nr; i++) {
+		char *kaddr = ext2_get_folio(dir, pos[i] >> PAGE_SHIFT, 0,
+					     foliop);
+		ext2_dirent *de;
+
+		if (IS_ERR(kaddr))
+			return ERR_CAST(kaddr);
+		de = (ext2_dirent *)(kaddr + offset_in_page(pos[i]));
+		if (ext2_match(child->len, child->name, de))
+			return de;
+		folio_release_kmap(*foliop, kaddr);
+	}
+	return ERR_PTR(-ENOENT);
+}
+
+/* A new entry for @name was stored at @pos. */
+void ext2_dir_cache_add(struct inode *dir, const char *name, int len,
+			loff_t pos)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	struct ext2_dir_cache_entry *e;
+	struct ext2_dir_cache *dc;
+
+	if (!READ_ONCE(ei->i_dir_cache))
+		return;
+	/* called with the directory folio locked, between prepare and commit */
+	e = kmem_cache_alloc(ext2_dir_cache_cachep, GFP_NOFS);
+	if (!e) {
+		/* The table must stay complete, so lose it instead. */
+		ext2_dir_cache_drop(dir);
+		return;
+	}
+	e->hash = ext2_dir_cache_hash(name, len);
+	e->pos = pos;
+	spin_lock(&ei->i_dir_cache_lock);
+	dc = ei->i_dir_cache;
+	if (dc) {
+		hlist_add_head(&e->node, ext2_dir_cache_bucket(dc, e->hash));
+		dc->nr++;
+		atomic_long_inc(&ext2_dir_cache_nr);
+		e = NULL;
+	}
+	spin_unlock(&ei->i_dir_cache_lock);
+	if (e)
+		kmem_cache_free(ext2_dir_cache_cachep, e);
+}
+
+/* The entry for @name at @pos was removed. */
+void ext2_dir_cache_del(struct inode *dir, const char *name, int len,
+			loff_t pos)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	struct ext2_dir_cache_entry *e = NULL;
+	struct ext2_dir_cache *dc;
+	u32 hash;
+
+	if (!READ_ONCE(ei->i_dir_cache))
+		return;
+	hash = ext2_dir_cache_hash(name, len);
+	spin_lock(&ei->i_dir_cache_lock);
+	dc = ei->i_dir_cache;
+	if (dc) {
+		hlist_for_each_entry(e, ext2_dir_cache_bucket(dc, hash), node) {
+			if (e->hash == hash && e->pos == pos) {
+				hlist_del(&e->node);
+				dc->nr--;
+				atomic_long_dec(&ext2_dir_cache_nr);
+				break;
+			}
+		}
+	}
+	spin_unlock(&ei->i_dir_cache_lock);
+	if (e)
+		kmem_cache_free(ext2_dir_cache_cachep, e);
+}
+
+static unsigned long ext2_dir_cache_count(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	return atomic_long_read(&ext2_dir_cache_nr);
+}
+
+/*
+ * Free whole tables from the cold end of the LRU, giving tables used since
+ * the last pass a second chance.
+ */
+static unsigned long ext2_dir_cache_scan(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	struct ext2_dir_cache *dc, *tmp;
+	unsigned long freed = 0, scanned = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&ext2_dir_cache_lock);
+	while (scanned < sc->nr_to_scan && !list_empty(&ext2_dir_cache_lru)) {
+		dc = list_last_entry(&ext2_dir_cache_lru,
+				     struct ext2_dir_cache, lru);
+		if (READ_ONCE(dc->referenced) ||
+		    !spin_trylock(&dc->ei->i_dir_cache_lock)) {
+			WRITE_ONCE(dc->referenced, false);
+			list_move(&dc->lru, &ext2_dir_cache_lru);
+			scanned++;
+			continue;
+		}
+		list_move(&dc->lru, &dispose);
+		dc->ei->i_dir_cache = NULL;
+		spin_unlock(&dc->ei->i_dir_cache_lock);
+		atomic_long_sub(dc->nr, &ext2_dir_cache_nr);
+		scanned += dc->nr;
+		freed += dc->nr;
+	}
+	spin_unlock(&ext2_dir_cache_lock);
+
+	list_for_each_entry_safe(dc, tmp, &dispose, lru)
+		ext2_dir_cache_free(dc);
+	return freed;
+}
+
+int __init ext2_init_dir_cache(void)
+{
+	ext2_dir_cache_cachep = KMEM_CACHE(ext2_dir_cache_entry,
+					   SLAB_RECLAIM_ACCOUNT);
+	if (!ext2_dir_cache_cachep)
+		return -ENOMEM;
+
+	ext2_dir_cache_shrinker = shrinker_alloc(0, "ext2-dircache");
+	if (!ext2_dir_cache_shrinker) {
+		kmem_cache_destroy(ext2_dir_cache_cachep);
+		return -ENOMEM;
+	}
+	ext2_dir_cache_shrinker->count_objects = ext2_dir_cache_count;
+	ext2_dir_cache_shrinker->scan_objects = ext2_dir_cache_scan;
+	shrinker_register(ext2_dir_cache_shrinker);
+	return 0;
+}
+
+void ext2_exit_dir_cache(void)
+{
+	shrinker_free(ext2_dir_cache_shrinker);
+	kmem_cache_destroy(ext2_dir_cache_cachep);
+}
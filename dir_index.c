@@ -0,0 +1,875 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/ext2/dir_index.c
+ *
+ * Hashed b-tree directory index, in the on-disk format used by ext3 and
+ * ext4 (Daniel Phillips' htree).
+ *
+ * An indexed directory is still a valid linear ext2 directory: block 0
+ * holds "." and ".." with the root of the index hidden inside the rec_len
+ * of "..", and interior index blocks look like a single unused entry
+ * spanning the whole block.  Kernels that do not know about the index
+ * simply see a few empty blocks; when they modify the directory they clear
+ * EXT2_INDEX_FL and we fall back to the linear code in dir.c.
+ *
+ * Leaf blocks are ordinary directory blocks.  Each one holds the names
+ * whose hashes fall in the range given by its index entry, so lookups read
+ * one block per level of the tree plus (usually) a single leaf.
+ *
+ * All index and leaf blocks are accessed through the directory's page
+ * cache, just like the rest of dir.c, and are modified under the parent's
+ * i_rwsem.  No two folios are ever locked at the same time.
+ */
+
+#include "ext2.h"
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+typedef struct ext2_dir_entry_2 ext2_dirent;
+
+struct fake_dirent {
+	__le32		inode;
+	__le16		rec_len;
+	u8		name_len;
+	u8		file_type;
+};
+
+struct dx_countlimit {
+	__le16		limit;
+	__le16		count;
+};
+
+struct dx_entry {
+	__le32		hash;
+	__le32		block;
+};
+
+/*
+ * dx_root_info is laid out so that if it should somehow get overlaid by a
+ * dirent the two low bits of the hash version will be zero.  Therefore, the
+ * hash version mod 4 should never be 0.  Sincerely, the paranoia department.
+ */
+struct dx_root {
+	struct fake_dirent dot;
+	char		dot_name[4];
+	struct fake_dirent dotdot;
+	char		dotdot_name[4];
+	struct dx_root_info {
+		__le32	reserved_zero;
+		u8	hash_version;
+		u8	info_length;	/* 8 */
+		u8	indirect_levels;
+		u8	unused_flags;
+	} info;
+	struct dx_entry	entries[];
+};
+
+struct dx_node {
+	struct fake_dirent fake;
+	struct dx_entry	entries[];
+};
+
+/*
+ * Maximum depth of the index below the root.  ext3 never builds more than
+ * one level of interior nodes, and neither do we.
+ */
+#define DX_MAX_LEVELS	2
+
+/* One level of a lookup path, recorded by block and slot. */
+struct dx_frame {
+	unsigned	block;		/* 0 for the root */
+	unsigned	at;		/* slot we descended through */
+	unsigned	count;
+	unsigned	limit;
+};
+
+struct dx_path {
+	struct ext2_dx_hash_info hinfo;
+	int		levels;
+	struct dx_frame	frames[DX_MAX_LEVELS];
+};
+
+/* Live entry of a leaf being split. */
+struct dx_map_entry {
+	u32		hash;
+	u16		offs;
+	u16		size;
+};
+
+static inline unsigned dx_root_limit(struct inode *dir)
+{
+	return (dir->i_sb->s_blocksize - sizeof(struct dx_root)) /
+		sizeof(struct dx_entry);
+}
+
+static inline unsigned dx_node_limit(struct inode *dir)
+{
+	return (dir->i_sb->s_blocksize - sizeof(struct dx_node)) /
+		sizeof(struct dx_entry);
+}
+
+static inline struct dx_entry *dx_entries(void *kaddr, unsigned block)
+{
+	if (block == 0)
+		return ((struct dx_root *)kaddr)->entries;
+	return ((struct dx_node *)kaddr)->entries;
+}
+
+static inline unsigned dx_nr_blocks(struct inode *dir)
+{
+	return dir->i_size >> dir->i_blkbits;
+}
+
+/*
+ * Map directory block @block, which may lie past i_size when the directory
+ * is being grown.  Release with folio_release_kmap().
+ */
+static void *dx_get_block(struct inode *dir, unsigned block,
+			  struct folio **foliop)
+{
+	unsigned shift = PAGE_SHIFT - dir->i_blkbits;
+	char *kaddr;
+
+	kaddr = ext2_get_folio(dir, block >> shift, 0, foliop);
+	if (IS_ERR(kaddr))
+		return kaddr;
+	return kaddr + ((block & ((1U << shift) - 1)) << dir->i_blkbits);
+}
+
+/*
+ * Map and lock block @block for modification.  dx_commit_block() writes it
+ * back and drops both the lock and the mapping.
+ */
+static void *dx_lock_block(struct inode *dir, unsigned block,
+			   struct folio **foliop)
+{
+	loff_t pos = (loff_t)block << dir->i_blkbits;
+	void *kaddr;
+	int err;
+
+	kaddr = dx_get_block(dir, block, foliop);
+	if (IS_ERR(kaddr))
+		return kaddr;
+	folio_lock(*foliop);
+	err = ext2_prepare_chunk(*foliop, pos, dir->i_sb->s_blocksize);
+	if (err) {
+		folio_unlock(*foliop);
+		folio_release_kmap(*foliop, kaddr);
+		return ERR_PTR(err);
+	}
+	return kaddr;
+}
+
+static void dx_commit_block(struct inode *dir, unsigned block,
+			    struct folio *folio, void *kaddr)
+{
+	loff_t pos = (loff_t)block << dir->i_blkbits;
+
+	ext2_commit_chunk(folio, pos, dir->i_sb->s_blocksize);
+	folio_release_kmap(folio, kaddr);
+}
+
+/* Replace the contents of @block, growing the directory if needed. */
+static int dx_write_block(struct inode *dir, unsigned block, const void *buf)
+{
+	struct folio *folio;
+	void *kaddr;
+
+	kaddr = dx_lock_block(dir, block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	memcpy(kaddr, buf, dir->i_sb->s_blocksize);
+	dx_commit_block(dir, block, folio, kaddr);
+	return 0;
+}
+
+static void dx_set_countlimit(struct dx_entry *entries, unsigned count,
+			      unsigned limit)
+{
+	struct dx_countlimit *cl = (struct dx_countlimit *)entries;
+
+	cl->count = cpu_to_le16(count);
+	cl->limit = cpu_to_le16(limit);
+}
+
+static int dx_corrupted(struct inode *dir, const char *what)
+{
+	ext2_msg(dir->i_sb, KERN_WARNING,
+		 "directory #%lu: bad htree index (%s), using linear scan",
+		 dir->i_ino, what);
+	return -EFSCORRUPTED;
+}
+
+/*
+ * Find the last entry whose hash is <= @hash.  Entry 0 covers everything
+ * below entries[1].hash and its hash field holds the count/limit instead.
+ */
+static unsigned dx_search(struct dx_entry *entries, unsigned count, u32 hash)
+{
+	unsigned lo = 1, hi = count - 1;
+
+	while (lo <= hi) {
+		unsigned mid = (lo + hi) / 2;
+
+		if (le32_to_cpu(entries[mid].hash) > hash)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return lo - 1;
+}
+
+/*
+ * Read the count/limit of an index block and descend through the slot
+ * recorded in @frame, or the one matching @hash if @by_hash.  Returns the
+ * child block in @child.
+ */
+static int dx_walk_block(struct inode *dir, struct dx_frame *frame,
+			 u32 hash, bool by_hash, unsigned *child)
+{
+	struct folio *folio;
+	struct dx_countlimit *cl;
+	struct dx_entry *entries;
+	void *kaddr;
+	unsigned limit;
+	int err = 0;
+
+	kaddr = dx_get_block(dir, frame->block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	entries = dx_entries(kaddr, frame->block);
+	cl = (struct dx_countlimit *)entries;
+	limit = frame->block ? dx_node_limit(dir) : dx_root_limit(dir);
+	frame->count = le16_to_cpu(cl->count);
+	frame->limit = le16_to_cpu(cl->limit);
+	if (frame->limit != limit) {
+		err = dx_corrupted(dir, "limit");
+		goto out;
+	}
+	if (!frame->count || frame->count > frame->limit) {
+		err = dx_corrupted(dir, "count");
+		goto out;
+	}
+	if (by_hash)
+		frame->at = dx_search(entries, frame->count, hash);
+	*child = le32_to_cpu(entries[frame->at].block);
+	if (!*child || *child >= dx_nr_blocks(dir))
+		err = dx_corrupted(dir, "block number");
+out:
+	folio_release_kmap(folio, kaddr);
+	return err;
+}
+
+/*
+ * Look up the leaf block that should hold @name, recording the path taken
+ * so that it can later be extended or continued.
+ */
+static int dx_probe(struct inode *dir, const struct qstr *name,
+		    struct dx_path *path, unsigned *leaf)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	struct folio *folio;
+	struct dx_root *root;
+	struct dx_root_info info;
+	unsigned block = 0;
+	int i, err;
+
+	if (dx_nr_blocks(dir) < 2)
+		return dx_corrupted(dir, "size");
+	root = dx_get_block(dir, 0, &folio);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	info = root->info;
+	folio_release_kmap(folio, root);
+
+	if (info.reserved_zero)
+		return dx_corrupted(dir, "reserved");
+	if (info.hash_version > EXT2_DX_HASH_TEA)
+		return dx_corrupted(dir, "hash version");
+	if (info.info_length != sizeof(info))
+		return dx_corrupted(dir, "info length");
+	if (info.indirect_levels >= DX_MAX_LEVELS)
+		return dx_corrupted(dir, "depth");
+
+	path->hinfo.hash_version = info.hash_version + sbi->s_hash_unsigned;
+	path->hinfo.seed = sbi->s_hash_seed;
+	ext2_dirhash(name->name, name->len, &path->hinfo);
+	path->levels = info.indirect_levels + 1;
+
+	for (i = 0; i < path->levels; i++) {
+		path->frames[i].block = block;
+		err = dx_walk_block(dir, &path->frames[i], path->hinfo.hash,
+				    true, &block);
+		if (err)
+			return err;
+	}
+	*leaf = block;
+	return 0;
+}
+
+/*
+ * A name whose hash collides with the start of the next leaf may have been
+ * pushed there by a split.  Step the path to that leaf if so; returns 1 if
+ * there is another leaf to search, 0 if not.
+ */
+static int dx_next_leaf(struct inode *dir, struct dx_path *path,
+			unsigned *leaf)
+{
+	struct dx_frame *frame;
+	struct folio *folio;
+	void *kaddr;
+	unsigned block;
+	u32 hash;
+	int i, err;
+
+	for (i = path->levels - 1; i >= 0; i--)
+		if (path->frames[i].at + 1 < path->frames[i].count)
+			break;
+	if (i < 0)
+		return 0;
+
+	frame = &path->frames[i];
+	kaddr = dx_get_block(dir, frame->block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	frame->at++;
+	hash = le32_to_cpu(dx_entries(kaddr, frame->block)[frame->at].hash);
+	block = le32_to_cpu(dx_entries(kaddr, frame->block)[frame->at].block);
+	folio_release_kmap(folio, kaddr);
+	if ((hash & ~1) != path->hinfo.hash)
+		return 0;
+	if (!block || block >= dx_nr_blocks(dir))
+		return dx_corrupted(dir, "block number");
+
+	for (i++; i < path->levels; i++) {
+		path->frames[i].block = block;
+		path->frames[i].at = 0;
+		err = dx_walk_block(dir, &path->frames[i], 0, false, &block);
+		if (err)
+			return err;
+	}
+	*leaf = block;
+	return 1;
+}
+
+struct ext2_dir_entry_2 *ext2_dx_find_entry(struct inode *dir,
+			const struct qstr *child, struct folio **foliop)
+{
+	unsigned reclen = EXT2_DIR_REC_LEN(child->len);
+	struct ext2_match_key key;
+	struct dx_path path;
+	unsigned leaf;
+	int err;
+
+	err = dx_probe(dir, child, &path, &leaf);
+	if (err)
+		return ERR_PTR(err);
+	ext2_match_key_init(&key, child->name, child->len);
+	do {
+		char *kaddr = dx_get_block(dir, leaf, foliop);
+		ext2_dirent *de;
+		char *top;
+
+		if (IS_ERR(kaddr))
+			return ERR_CAST(kaddr);
+		de = (ext2_dirent *)kaddr;
+		top = kaddr + dir->i_sb->s_blocksize - reclen;
+		while ((char *)de <= top) {
+			if (ext2_match_key(&key, de))
+				return de;
+			de = ext2_next_entry(de);
+		}
+		folio_release_kmap(*foliop, kaddr);
+		err = dx_next_leaf(dir, &path, &leaf);
+	} while (err > 0);
+	return ERR_PTR(err ? err : -ENOENT);
+}
+
+/*
+ * Try to add @name to leaf block @block.  Returns -ENOSPC if it is full.
+ */
+static int dx_add_to_leaf(struct inode *dir, unsigned block,
+			  const struct qstr *name, struct inode *inode)
+{
+	unsigned reclen = EXT2_DIR_REC_LEN(name->len);
+	struct ext2_match_key key;
+	struct folio *folio;
+	char *kaddr, *top;
+	ext2_dirent *de;
+	int err;
+
+	kaddr = dx_get_block(dir, block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	ext2_match_key_init(&key, name->name, name->len);
+	folio_lock(folio);
+	de = (ext2_dirent *)kaddr;
+	top = kaddr + dir->i_sb->s_blocksize - reclen;
+	while ((char *)de <= top) {
+		unsigned name_len = 0;
+
+		err = -EEXIST;
+		if (ext2_match_key(&key, de))
+			goto out_unlock;
+		if (de->inode)
+			name_len = EXT2_DIR_REC_LEN(de->name_len);
+		if (ext2_rec_len_from_disk(de->rec_len) >= name_len + reclen) {
+			err = ext2_insert_entry(dir, folio, de, name, inode);
+			goto out;
+		}
+		de = ext2_next_entry(de);
+	}
+	err = -ENOSPC;
+out_unlock:
+	folio_unlock(folio);
+out:
+	folio_release_kmap(folio, kaddr);
+	return err;
+}
+
+/*
+ * Insert (@hash, @block) into index block @frame right after the slot the
+ * path went through.  The caller has made sure there is room.
+ */
+static int dx_insert_index(struct inode *dir, struct dx_frame *frame,
+			   u32 hash, unsigned block)
+{
+	struct dx_entry *entries, *new;
+	struct folio *folio;
+	void *kaddr;
+
+	kaddr = dx_lock_block(dir, frame->block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	entries = dx_entries(kaddr, frame->block);
+	new = entries + frame->at + 1;
+	memmove(new + 1, new, (frame->count - frame->at - 1) * sizeof(*new));
+	new->hash = cpu_to_le32(hash);
+	new->block = cpu_to_le32(block);
+	frame->count++;
+	dx_set_countlimit(entries, frame->count, frame->limit);
+	dx_commit_block(dir, frame->block, folio, kaddr);
+	return 0;
+}
+
+/*
+ * Make sure the index block above the leaf can take one more entry, either
+ * by splitting an interior node or by pushing the root entries down into a
+ * new node.  @buf is a scratch block.
+ */
+static int dx_make_room(struct inode *dir, struct dx_path *path, char *buf)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	struct dx_frame *frame = &path->frames[path->levels - 1];
+	struct dx_frame *root = &path->frames[0];
+	struct dx_node *node = (struct dx_node *)buf;
+	unsigned newblock = dx_nr_blocks(dir);
+	struct dx_entry *entries;
+	struct folio *folio;
+	void *kaddr;
+	int err;
+
+	if (frame->count < frame->limit)
+		return 0;
+
+	memset(buf, 0, blocksize);
+	node->fake.rec_len = ext2_rec_len_to_disk(blocksize);
+
+	if (path->levels == 1) {
+		/* Move the root entries into a new node below it. */
+		kaddr = dx_get_block(dir, 0, &folio);
+		if (IS_ERR(kaddr))
+			return PTR_ERR(kaddr);
+		memcpy(node->entries, dx_entries(kaddr, 0),
+		       root->count * sizeof(struct dx_entry));
+		folio_release_kmap(folio, kaddr);
+		dx_set_countlimit(node->entries, root->count,
+				  dx_node_limit(dir));
+		err = dx_write_block(dir, newblock, buf);
+		if (err)
+			return err;
+
+		kaddr = dx_lock_block(dir, 0, &folio);
+		if (IS_ERR(kaddr))
+			return PTR_ERR(kaddr);
+		entries = dx_entries(kaddr, 0);
+		entries[0].block = cpu_to_le32(newblock);
+		dx_set_countlimit(entries, 1, root->limit);
+		((struct dx_root *)kaddr)->info.indirect_levels = 1;
+		dx_commit_block(dir, 0, folio, kaddr);
+
+		path->frames[1].block = newblock;
+		path->frames[1].at = root->at;
+		path->frames[1].count = root->count;
+		path->frames[1].limit = dx_node_limit(dir);
+		root->at = 0;
+		root->count = 1;
+		path->levels = 2;
+		return 0;
+	}
+
+	if (root->count >= root->limit) {
+		ext2_msg(dir->i_sb, KERN_WARNING,
+			 "directory #%lu: index full", dir->i_ino);
+		return -ENOSPC;
+	}
+
+	/*
+	 * Split the full node: its upper half moves to a new node, which is
+	 * linked into the root before the old node is shortened, so the
+	 * index is valid at every step.
+	 */
+	{
+		unsigned count1 = frame->count / 2;
+		unsigned count2 = frame->count - count1;
+		u32 hash2;
+
+		kaddr = dx_get_block(dir, frame->block, &folio);
+		if (IS_ERR(kaddr))
+			return PTR_ERR(kaddr);
+		entries = dx_entries(kaddr, frame->block);
+		memcpy(node->entries, entries + count1,
+		       count2 * sizeof(struct dx_entry));
+		hash2 = le32_to_cpu(entries[count1].hash);
+		folio_release_kmap(folio, kaddr);
+		dx_set_countlimit(node->entries, count2, frame->limit);
+		err = dx_write_block(dir, newblock, buf);
+		if (err)
+			return err;
+		err = dx_insert_index(dir, root, hash2, newblock);
+		if (err)
+			return err;
+
+		kaddr = dx_lock_block(dir, frame->block, &folio);
+		if (IS_ERR(kaddr))
+			return PTR_ERR(kaddr);
+		dx_set_countlimit(dx_entries(kaddr, frame->block), count1,
+				  frame->limit);
+		dx_commit_block(dir, frame->block, folio, kaddr);
+
+		if (frame->at >= count1) {
+			frame->block = newblock;
+			frame->at -= count1;
+			frame->count = count2;
+			root->at++;
+		} else {
+			frame->count = count1;
+		}
+	}
+	return 0;
+}
+
+static int dx_map_cmp(const void *a, const void *b)
+{
+	const struct dx_map_entry *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Merge every dead entry of leaf @buf into the one before it, as unlink
+ * does.  No live entry moves.  Returns whether anything was merged.
+ */
+static bool dx_coalesce_leaf(char *buf, unsigned blocksize)
+{
+	ext2_dirent *de, *prev = NULL;
+	unsigned off, rec_len;
+	bool merged = false;
+
+	for (off = 0; off < blocksize; off += rec_len) {
+		de = (ext2_dirent *)(buf + off);
+		rec_len = ext2_rec_len_from_disk(de->rec_len);
+		if (!de->inode && prev) {
+			prev->rec_len = ext2_rec_len_to_disk(
+				ext2_rec_len_from_disk(prev->rec_len) +
+				rec_len);
+			merged = true;
+			continue;
+		}
+		prev = de;
+	}
+	return merged;
+}
+
+/*
+ * Pack the live entries of leaf @buf at its start, in the order they are
+ * in, so that all of its free space is in the last entry.  This is what
+ * ext3's dx_pack_dirents() does.
+ */
+static void dx_pack_leaf(char *buf, unsigned blocksize)
+{
+	ext2_dirent *de, *to = NULL;
+	unsigned off, rec_len, size, used = 0;
+
+	for (off = 0; off < blocksize; off += rec_len) {
+		de = (ext2_dirent *)(buf + off);
+		rec_len = ext2_rec_len_from_disk(de->rec_len);
+		if (!de->inode)
+			continue;
+		size = EXT2_DIR_REC_LEN(de->name_len);
+		to = (ext2_dirent *)(buf + used);
+		memmove(to, de, size);
+		to->rec_len = ext2_rec_len_to_disk(size);
+		used += size;
+	}
+	if (!to) {
+		to = (ext2_dirent *)buf;
+		to->inode = 0;
+		to->name_len = 0;
+	}
+	to->rec_len = ext2_rec_len_to_disk(blocksize - ((char *)to - buf));
+}
+
+/*
+ * Split full leaf @leaf by hash: the upper half of its entries (by space
+ * used) is copied to a new block at the end of the directory, the new block
+ * is added to the index, and only then are the moved entries removed from
+ * the old leaf.
+ *
+ * ext2_readdir() goes by offset, and an entry moved below the position a
+ * reader resumes at would never be returned to it.  So while anyone has the
+ * directory open, the entries left behind keep their offsets, and the space
+ * of the moved ones is merged into the entries before them.  That may leave
+ * no single slot a long name fits in; ext2_dx_add_link() then splits again,
+ * which ends at a leaf with one entry, and that has room for any name.
+ * With no reader about, what is left is packed instead, as ext3 does.
+ */
+static int dx_split_leaf(struct inode *dir, struct dx_path *path,
+			 unsigned leaf)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	struct dx_map_entry *map;
+	struct ext2_dx_hash_info hinfo = path->hinfo;
+	char *buf, *hi, *kaddr;
+	struct folio *folio;
+	ext2_dirent *de, *last = NULL;
+	unsigned n = 0, split, size, i, off, newblock;
+	u32 hash2;
+	bool readers = atomic_read(&EXT2_I(dir)->i_dir_openers);
+	int err;
+
+	buf = kmalloc(2 * blocksize, GFP_NOFS);
+	map = kmalloc_array(blocksize / EXT2_DIR_REC_LEN(1), sizeof(*map),
+			    GFP_NOFS);
+	err = -ENOMEM;
+	if (!buf || !map)
+		goto out;
+	hi = buf + blocksize;
+
+	kaddr = dx_get_block(dir, leaf, &folio);
+	if (IS_ERR(kaddr)) {
+		err = PTR_ERR(kaddr);
+		goto out;
+	}
+	memcpy(buf, kaddr, blocksize);
+	folio_release_kmap(folio, kaddr);
+
+	for (off = 0; off < blocksize; off += ext2_rec_len_from_disk(de->rec_len)) {
+		de = (ext2_dirent *)(buf + off);
+		if (!de->inode)
+			continue;
+		ext2_dirhash(de->name, de->name_len, &hinfo);
+		map[n].hash = hinfo.hash;
+		map[n].offs = off;
+		map[n].size = EXT2_DIR_REC_LEN(de->name_len);
+		n++;
+	}
+	if (n < 2) {
+		err = 0;
+		if (!readers)
+			goto pack;
+		/* with its free space merged, one entry leaves room for any */
+		if (dx_coalesce_leaf(buf, blocksize))
+			goto write;
+		err = dx_corrupted(dir, "full leaf");
+		goto out;
+	}
+	sort(map, n, sizeof(*map), dx_map_cmp, NULL);
+
+	/* Move the top entries, up to half a block's worth. */
+	size = 0;
+	for (split = n; split > 1; split--) {
+		if (size + map[split - 1].size > blocksize / 2)
+			break;
+		size += map[split - 1].size;
+	}
+	if (split == n)
+		split--;
+	hash2 = map[split].hash;
+	if (hash2 == map[split - 1].hash)
+		hash2 |= 1;	/* continued from the previous leaf */
+
+	err = dx_make_room(dir, path, hi);
+	if (err)
+		goto out;
+
+	/* Build and write the new leaf. */
+	memset(hi, 0, blocksize);
+	off = 0;
+	for (i = split; i < n; i++) {
+		de = (ext2_dirent *)(hi + off);
+		memcpy(de, buf + map[i].offs, map[i].size);
+		de->rec_len = ext2_rec_len_to_disk(map[i].size);
+		last = de;
+		off += map[i].size;
+	}
+	last->rec_len = ext2_rec_len_to_disk(blocksize - ((char *)last - hi));
+	newblock = dx_nr_blocks(dir);
+	err = dx_write_block(dir, newblock, hi);
+	if (err)
+		goto out;
+
+	err = dx_insert_index(dir, &path->frames[path->levels - 1], hash2,
+			      newblock);
+	if (err)
+		goto out;
+
+	/* Drop the moved entries from the old leaf. */
+	for (i = split; i < n; i++)
+		((ext2_dirent *)(buf + map[i].offs))->inode = 0;
+	if (readers) {
+		dx_coalesce_leaf(buf, blocksize);
+		goto write;
+	}
+pack:
+	dx_pack_leaf(buf, blocksize);
+write:
+	kaddr = dx_lock_block(dir, leaf, &folio);
+	if (IS_ERR(kaddr)) {
+		err = PTR_ERR(kaddr);
+		goto out;
+	}
+	memcpy(kaddr, buf, blocksize);
+	dx_commit_block(dir, leaf, folio, kaddr);
+out:
+	kfree(map);
+	kfree(buf);
+	return err;
+}
+
+/*
+ * Add @dentry to an indexed directory.  Returns -EFSCORRUPTED if the index
+ * cannot be used, in which case the caller falls back to a linear insert.
+ */
+int ext2_dx_add_link(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = d_inode(dentry->d_parent);
+	struct dx_path path;
+	unsigned leaf;
+	int err;
+
+	for (;;) {
+		err = dx_probe(dir, &dentry->d_name, &path, &leaf);
+		if (err)
+			return err;
+		err = dx_add_to_leaf(dir, leaf, &dentry->d_name, inode);
+		if (err != -ENOSPC)
+			return err;
+		err = dx_split_leaf(dir, &path, leaf);
+		if (err)
+			return err;
+	}
+}
+
+/*
+ * Convert a full single-block directory into an indexed one: everything
+ * but "." and ".." moves to a new leaf in block 1, and block 0 becomes the
+ * index root with a single entry pointing at it.  @dentry is then added
+ * through the index.
+ */
+int ext2_dx_make_indexed(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = d_inode(dentry->d_parent);
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	struct dx_root *root;
+	ext2_dirent *dot, *dotdot, *de, *last = NULL;
+	struct folio *folio;
+	char *buf, *leaf, *kaddr, *top;
+	unsigned off;
+	int err;
+
+	buf = kmalloc(2 * blocksize, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+	leaf = buf + blocksize;
+
+	kaddr = dx_get_block(dir, 0, &folio);
+	if (IS_ERR(kaddr)) {
+		err = PTR_ERR(kaddr);
+		goto out;
+	}
+	memcpy(buf, kaddr, blocksize);
+	folio_release_kmap(folio, kaddr);
+
+	dot = (ext2_dirent *)buf;
+	dotdot = ext2_next_entry(dot);
+	if (dot->name_len != 1 || dot->name[0] != '.' ||
+	    (char *)dotdot >= buf + blocksize - EXT2_DIR_REC_LEN(2) ||
+	    dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2)) {
+		ext2_error(dir->i_sb, __func__,
+			   "directory #%lu: bad '.' or '..' entry",
+			   dir->i_ino);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+
+	/* Pack everything after ".." into the first leaf. */
+	memset(leaf, 0, blocksize);
+	off = 0;
+	top = buf + blocksize;
+	for (de = ext2_next_entry(dotdot); (char *)de < top;
+	     de = ext2_next_entry(de)) {
+		unsigned size = EXT2_DIR_REC_LEN(de->name_len);
+
+		if (!de->inode)
+			continue;
+		last = (ext2_dirent *)(leaf + off);
+		memcpy(last, de, size);
+		last->rec_len = ext2_rec_len_to_disk(size);
+		off += size;
+	}
+	if (!last)
+		last = (ext2_dirent *)leaf;
+	last->rec_len = ext2_rec_len_to_disk(blocksize - ((char *)last - leaf));
+	err = dx_write_block(dir, 1, leaf);
+	if (err)
+		goto out;
+
+	/* Turn block 0 into the root, reusing the leaf buffer. */
+	memset(leaf, 0, blocksize);
+	root = (struct dx_root *)leaf;
+	root->dot.inode = dot->inode;
+	root->dot.rec_len = ext2_rec_len_to_disk(EXT2_DIR_REC_LEN(1));
+	root->dot.name_len = 1;
+	root->dot.file_type = dot->file_type;
+	root->dot_name[0] = '.';
+	root->dotdot.inode = dotdot->inode;
+	root->dotdot.rec_len =
+		ext2_rec_len_to_disk(blocksize - EXT2_DIR_REC_LEN(1));
+	root->dotdot.name_len = 2;
+	root->dotdot.file_type = dotdot->file_type;
+	root->dotdot_name[0] = '.';
+	root->dotdot_name[1] = '.';
+	root->info.hash_version = sbi->s_def_hash_version;
+	root->info.info_length = sizeof(root->info);
+	dx_set_countlimit(root->entries, 1, dx_root_limit(dir));
+	root->entries[0].block = cpu_to_le32(1);
+	err = dx_write_block(dir, 0, leaf);
+	if (err)
+		goto out;
+
+	EXT2_I(dir)->i_flags |= EXT2_INDEX_FL;
+	mark_inode_dirty(dir);
+	ext2_dir_cache_drop(dir);
+	ext2_dir_gaps_drop(dir);
+	kfree(buf);
+	return ext2_dx_add_link(dentry, inode);
+out:
+	kfree(buf);
+	return err;
+}
@@ -16,10 +16,12 @@
 #include <linux/fs.h>
 #include <linux/ext2_fs.h>
 #include <linux/blockgroup_lock.h>
+#include <linux/buffer_head.h>
 #include <linux/percpu_counter.h>
 #include <linux/rbtree.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
+#include <asm/unaligned.h>
 
 /* XXX Here for now... not interested in restructing headers JUST now */
 
@@ -68,6 +70,41 @@ struct ext2_block_alloc_info {
 
 struct mb_cache;
 
+#define EXT2_GI_QUARTILES	4
+#define EXT2_GI_BUCKETS		(EXT2_GI_QUARTILES * EXT2_GI_QUARTILES)
+
+enum {
+	EXT2_BLOCK_BITMAP,
+	EXT2_INODE_BITMAP,
+	EXT2_NR_BITMAPS
+};
+
+struct ext2_group_info {
+	struct list_head	gi_list;	/* in s_group_buckets[gi_bucket] */
+	int			gi_bucket;
+	/* bitmaps pinned by bitmap_cache.c, under the group lock */
+	struct buffer_head	*gi_bitmap[EXT2_NR_BITMAPS];
+	struct list_head	gi_bitmap_lru;	/* in s_bitmap_lru if pinned */
+	bool			gi_bitmap_referenced;
+};
+
+/*
+ * Changes to the free inode and directory counts of a group, and to its
+ * s_debts, that this CPU made and has not yet added to the descriptor.
+ * A group has one slot per CPU, the one at group % EXT2_IDELTA_SLOTS.
+ */
+#define EXT2_IDELTA_SLOTS	8
+
+struct ext2_inode_deltas {
+	spinlock_t		lock;
+	struct {
+		unsigned int	group;
+		short		free;
+		short		dirs;
+		short		debt;
+	} slot[EXT2_IDELTA_SLOTS];
+};
+
 /*
  * second extended-fs super-block data in memory
  */
@@ -84,6 +121,14 @@ struct ext2_sb_info {
 	struct buffer_head * s_sbh;	/* Buffer containing the super block */
 	struct ext2_super_block * s_es;	/* Pointer to the super block in the buffer */
 	struct buffer_head ** s_group_desc;
+	/*
+	 * With -o lazy_gdt the s_group_desc blocks are read on first use, not
+	 * at mount.  s_gdt_loaded counts the ones in place; s_gdt_mutex
+	 * serialises putting them there.
+	 */
+	unsigned long s_gdt_loaded;
+	unsigned long s_logic_sb_block;
+	struct mutex s_gdt_mutex;
 	unsigned long  s_mount_opt;
 	unsigned long s_sb_block;
 	kuid_t s_resuid;
@@ -94,10 +139,25 @@ struct ext2_sb_info {
 	int s_desc_per_block_bits;
 	int s_inode_size;
 	int s_first_ino;
+	u32 s_hash_seed[4];		/* directory index hash seed */
+	int s_def_hash_version;
+	int s_hash_unsigned;		/* 3 if hash should be unsigned, 0 if not */
 	spinlock_t s_next_gen_lock;
 	u32 s_next_generation;
 	unsigned long s_dir_count;
 	u8 *s_debts;
+	/* pending group inode counts, see ext2_adjust_inode_counts() */
+	struct ext2_inode_deltas __percpu *s_inode_deltas;
+	struct delayed_work s_idelta_work;
+	/*
+	 * Every group sits in one of s_group_buckets, picked by the quartiles
+	 * of its free inode and free block counts.  Directory placement looks
+	 * at a few groups from the right buckets instead of at all of them.
+	 * Protected by s_group_info_lock.
+	 */
+	struct ext2_group_info *s_group_info;
+	struct list_head s_group_buckets[EXT2_GI_BUCKETS];
+	spinlock_t s_group_info_lock;
 	struct percpu_counter s_freeblocks_counter;
 	struct percpu_counter s_freeinodes_counter;
 	struct percpu_counter s_dirs_counter;
@@ -118,14 +178,84 @@ struct ext2_sb_info {
 	struct mb_cache *s_ea_block_cache;
 	struct dax_device *s_daxdev;
 	u64 s_dax_part_off;
+	struct super_block *s_sb;
+
+	/*
+	 * Unlinked inodes whose blocks are freed in the background by
+	 * s_orphan_work (-o defer_free), and the blocks and inodes they
+	 * still hold.  Protected by s_orphan_lock.
+	 */
+	spinlock_t s_orphan_lock;
+	struct list_head s_orphan_list;
+	unsigned long s_orphan_blocks;
+	unsigned long s_orphan_count;
+	struct work_struct s_orphan_work;
+
+	/*
+	 * Directories left with empty blocks by unlink, repacked by
+	 * s_compact_work (-o autocompact).  Protected by s_compact_lock.
+	 */
+	spinlock_t s_compact_lock;
+	struct list_head s_compact_list;
+	struct delayed_work s_compact_work;
+
+	/*
+	 * Directories holding a pool of reserved inode numbers (-o
+	 * inode_pool), and how many inodes those pools hold in all.
+	 * Protected by s_ino_pool_lock.
+	 */
+	spinlock_t s_ino_pool_lock;
+	struct list_head s_ino_pools;
+	unsigned long s_pooled_inodes;
+
+	/* one lock per group instead of the hashed ones (-o numa_groups) */
+	spinlock_t *s_group_locks;
+
+	/*
+	 * With uninit_bg, s_itable_work zeroes the unused part of the inode
+	 * tables (-o init_itable), starting at group s_itable_next.  It holds
+	 * s_itable_sem for write while it does one group; new inodes past
+	 * bg_itable_unused of a group not yet zeroed hold it for read.
+	 */
+	struct delayed_work s_itable_work;
+	struct rw_semaphore s_itable_sem;
+	unsigned long s_itable_next;
+
+	/*
+	 * Groups whose bitmaps bitmap_cache.c holds a reference to, most
+	 * recently pinned first, and how many.  Protected by s_bitmap_lock,
+	 * which nests outside the group locks.
+	 */
+	spinlock_t s_bitmap_lock;
+	struct list_head s_bitmap_lru;
+	unsigned long s_bitmap_nr;
+	struct shrinker *s_bitmap_shrinker;
+
+	/*
+	 * Runs of blocks freed with -o discard.  They stay in use in the
+	 * bitmaps until s_discard_work has discarded them, and count as
+	 * free space meanwhile.  Protected by s_discard_lock.
+	 */
+	spinlock_t s_discard_lock;
+	struct list_head s_discard_list;
+	unsigned long s_discard_blocks;
+	struct delayed_work s_discard_work;
 };
 
 static inline spinlock_t *
 sb_bgl_lock(struct ext2_sb_info *sbi, unsigned int block_group)
 {
+	if (sbi->s_group_locks)
+		return &sbi->s_group_locks[block_group];
 	return bgl_lock_ptr(sbi->s_blockgroup_lock, block_group);
 }
 
+/* Not every descriptor block has been read yet (-o lazy_gdt) */
+static inline bool ext2_gdt_partial(struct ext2_sb_info *sbi)
+{
+	return READ_ONCE(sbi->s_gdt_loaded) < sbi->s_gdb_count;
+}
+
 /*
  * Define EXT2FS_DEBUG to produce debug messages
  */
@@ -198,10 +328,26 @@ struct ext2_group_desc
 	__le16	bg_free_blocks_count;	/* Free blocks count */
 	__le16	bg_free_inodes_count;	/* Free inodes count */
 	__le16	bg_used_dirs_count;	/* Directories count */
-	__le16	bg_pad;
-	__le32	bg_reserved[3];
+	__le16	bg_flags;		/* EXT2_BG_* (uninit_bg) */
+	__le32	bg_reserved[2];
+	__le16	bg_itable_unused;	/* Never used inodes at end of group */
+	__le16	bg_checksum;		/* crc16(uuid+group+desc) */
+};
+
+/*
+ * Group descriptor flags, only valid with RO_COMPAT_GDT_CSUM (uninit_bg)
+ */
+#define EXT2_BG_INODE_UNINIT	0x0001	/* Inode bitmap never written */
+#define EXT2_BG_BLOCK_UNINIT	0x0002	/* Block bitmap never written */
+#define EXT2_BG_INODE_ZEROED	0x0004	/* Inode table is zeroed */
+
+/* Bitmap of an EXT2_BG_*_UNINIT group, built in memory rather than read */
+enum ext2_state_bits {
+	BH_Ext2_Uninit = BH_PrivateStart,
 };
 
+BUFFER_FNS(Ext2_Uninit, ext2_uninit)
+
 /*
  * Macro-instructions used to manage group descriptors
  */
@@ -279,6 +425,77 @@ static inline __u32 ext2_mask_flags(umode_t mode, __u32 flags)
 #define	EXT2_IOC_SETVERSION		FS_IOC_SETVERSION
 #define	EXT2_IOC_GETRSVSZ		_IOR('f', 5, long)
 #define	EXT2_IOC_SETRSVSZ		_IOW('f', 6, long)
+#define	EXT2_IOC_COMPACT_DIR		_IO('f', 7)
+#define	EXT2_IOC_BULKSTAT		_IOWR('f', 8, struct ext2_bulkstat)
+#define	EXT2_IOC_DEFRAG			_IOWR('f', 9, struct ext2_defrag)
+#define	EXT2_IOC_FRAGSTAT		_IOWR('f', 10, struct ext2_fragstat)
+
+/*
+ * EXT2_IOC_BULKSTAT: the entries of a directory together with the
+ * attributes of the inodes they name, starting at directory offset bs_pos.
+ * On return bs_count holds the number of entries stored at bs_buf and
+ * bs_pos the offset to continue from; bs_count is 0 at the end.  "." and
+ * ".." are left out.
+ */
+struct ext2_bulkstat {
+	__u64	bs_pos;
+	__u64	bs_buf;		/* struct ext2_bulkstat_entry[bs_count] */
+	__u32	bs_count;
+	__u32	bs_flags;
+};
+
+#define EXT2_BULKSTAT_CRTIME		0x0001	/* fill in bse_crtime */
+
+struct ext2_bulkstat_entry {
+	__u64	bse_ino;
+	__u64	bse_size;
+	__s64	bse_mtime;
+	__s64	bse_crtime;	/* 0 if not recorded or not asked for */
+	__u32	bse_mtime_nsec;
+	__u16	bse_mode;	/* 0 if the inode could not be read */
+	__u8	bse_file_type;
+	__u8	bse_name_len;
+	char	bse_name[EXT2_NAME_LEN + 1];
+};
+
+/*
+ * EXT2_IOC_DEFRAG: move the data blocks of a regular file, from block
+ * df_start for df_len blocks (0: to the end of the file), to contiguous
+ * runs.  On return df_moved holds the number of blocks moved, and the
+ * other two the number of extents FIEMAP reported for the range before
+ * and after.
+ */
+struct ext2_defrag {
+	__u64	df_start;
+	__u64	df_len;
+	__u64	df_moved;
+	__u32	df_flags;		/* none defined yet, must be 0 */
+	__u32	df_extents_before;
+	__u32	df_extents_after;
+	__u32	df_reserved;
+};
+
+/*
+ * EXT2_IOC_FRAGSTAT: fragmentation of a regular file, from its block map,
+ * or with EXT2_FRAGSTAT_FS of the whole filesystem, from the block bitmaps.
+ * An extent is a run of physically contiguous blocks; for the filesystem
+ * the in-use runs include metadata.  Average extent length and indirect
+ * block overhead are fr_blocks / fr_extents and fr_meta_blocks / fr_blocks.
+ */
+struct ext2_fragstat {
+	__u32	fr_flags;
+	__u32	fr_reserved;
+	__u64	fr_blocks;		/* data blocks, or blocks in use */
+	__u64	fr_extents;
+	__u64	fr_max_extent;		/* longest extent, in blocks */
+	__u64	fr_meta_blocks;		/* indirect blocks of the file */
+	__u64	fr_free_blocks;		/* the rest: EXT2_FRAGSTAT_FS only */
+	__u64	fr_free_extents;
+	__u64	fr_max_free_extent;
+};
+
+#define EXT2_FRAGSTAT_FS		0x0001	/* the whole filesystem */
+#define EXT2_FRAGSTAT_PARALLEL		0x0002	/* groups on all CPUs */
 
 /*
  * ioctl commands in 32 bit emulation
@@ -362,6 +579,12 @@ struct ext2_inode {
 #define	EXT2_ERROR_FS			0x0002	/* Errors detected */
 #define	EFSCORRUPTED			EUCLEAN	/* Filesystem is corrupted */
 
+/*
+ * Misc. filesystem flags (s_flags)
+ */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001	/* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	/* Unsigned dirhash in use */
+
 /*
  * Mount flags
  */
@@ -381,6 +604,15 @@ struct ext2_inode {
 #define EXT2_MOUNT_GRPQUOTA		0x040000  /* group quota */
 #define EXT2_MOUNT_RESERVATION		0x080000  /* Preallocation */
 #define EXT2_MOUNT_DAX			0x100000  /* Direct Access */
+#define EXT2_MOUNT_DEFER_FREE		0x200000  /* Free unlinked inodes in background */
+#define EXT2_MOUNT_DIRCACHE		0x400000  /* Cache directory name hashes */
+#define EXT2_MOUNT_AUTOCOMPACT		0x800000  /* Shrink sparse directories */
+#define EXT2_MOUNT_READDIR_RA		0x1000000 /* Inode readahead in readdir */
+#define EXT2_MOUNT_INODE_POOL		0x2000000 /* Reserve inodes in batches */
+#define EXT2_MOUNT_NUMA_GROUPS		0x4000000 /* Per-node groups, group locks */
+#define EXT2_MOUNT_INIT_ITABLE		0x8000000 /* Zero inode tables lazily */
+#define EXT2_MOUNT_LAZY_GDT		0x10000000 /* Read descriptors on demand */
+#define EXT2_MOUNT_DISCARD		0x20000000 /* Discard freed blocks */
 
 
 #define clear_opt(o, opt)		o &= ~EXT2_MOUNT_##opt
@@ -465,7 +697,7 @@ struct ext2_super_block {
 	 */
 	__u8	s_prealloc_blocks;	/* Nr of blocks to try to preallocate*/
 	__u8	s_prealloc_dir_blocks;	/* Nr to preallocate for dirs */
-	__u16	s_padding1;
+	__le16	s_reserved_gdt_blocks;	/* Per group desc for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -473,13 +705,21 @@ struct ext2_super_block {
 	__u32	s_journal_inum;		/* inode number of journal file */
 	__u32	s_journal_dev;		/* device number of journal file */
 	__u32	s_last_orphan;		/* start of list of inodes to delete */
-	__u32	s_hash_seed[4];		/* HTREE hash seed */
+	__le32	s_hash_seed[4];		/* HTREE hash seed */
 	__u8	s_def_hash_version;	/* Default hash version to use */
 	__u8	s_reserved_char_pad;
 	__u16	s_reserved_word_pad;
 	__le32	s_default_mount_opts;
  	__le32	s_first_meta_bg; 	/* First metablock block group */
-	__u32	s_reserved[190];	/* Padding to the end of the block */
+	__le32	s_mkfs_time;		/* When the filesystem was created */
+	__le32	s_jnl_blocks[17];	/* Backup of the journal inode */
+	__le32	s_blocks_count_hi;	/* Unused by ext2 */
+	__le32	s_r_blocks_count_hi;
+	__le32	s_free_blocks_hi;
+	__le16	s_min_extra_isize;
+	__le16	s_want_extra_isize;
+	__le32	s_flags;		/* Miscellaneous flags */
+	__u32	s_reserved[167];	/* Padding to the end of the block */
 };
 
 /*
@@ -536,6 +776,7 @@ struct ext2_super_block {
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
 #define EXT2_FEATURE_RO_COMPAT_BTREE_DIR	0x0004
+#define EXT2_FEATURE_RO_COMPAT_GDT_CSUM		0x0010
 #define EXT2_FEATURE_RO_COMPAT_ANY		0xffffffff
 
 #define EXT2_FEATURE_INCOMPAT_COMPRESSION	0x0001
@@ -545,12 +786,14 @@ struct ext2_super_block {
 #define EXT2_FEATURE_INCOMPAT_META_BG		0x0010
 #define EXT2_FEATURE_INCOMPAT_ANY		0xffffffff
 
-#define EXT2_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
+#define EXT2_FEATURE_COMPAT_SUPP	(EXT2_FEATURE_COMPAT_EXT_ATTR| \
+					 EXT2_FEATURE_COMPAT_DIR_INDEX)
 #define EXT2_FEATURE_INCOMPAT_SUPP	(EXT2_FEATURE_INCOMPAT_FILETYPE| \
 					 EXT2_FEATURE_INCOMPAT_META_BG)
 #define EXT2_FEATURE_RO_COMPAT_SUPP	(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT2_FEATURE_RO_COMPAT_LARGE_FILE| \
-					 EXT2_FEATURE_RO_COMPAT_BTREE_DIR)
+					 EXT2_FEATURE_RO_COMPAT_BTREE_DIR| \
+					 EXT2_FEATURE_RO_COMPAT_GDT_CSUM)
 #define EXT2_FEATURE_RO_COMPAT_UNSUPPORTED	~EXT2_FEATURE_RO_COMPAT_SUPP
 #define EXT2_FEATURE_INCOMPAT_UNSUPPORTED	~EXT2_FEATURE_INCOMPAT_SUPP
 
@@ -610,6 +853,135 @@ struct ext2_dir_entry_2 {
 					 ~EXT2_DIR_ROUND)
 #define EXT2_MAX_REC_LEN		((1<<16)-1)
 
+/*
+ * Tests against MAX_REC_LEN etc were put in place for 64k block
+ * sizes; if that is not possible on this arch, we can skip
+ * those tests and speed things up.
+ */
+static inline unsigned ext2_rec_len_from_disk(__le16 dlen)
+{
+	unsigned len = le16_to_cpu(dlen);
+
+#if (PAGE_SIZE >= 65536)
+	if (len == EXT2_MAX_REC_LEN)
+		return 1 << 16;
+#endif
+	return len;
+}
+
+static inline __le16 ext2_rec_len_to_disk(unsigned len)
+{
+#if (PAGE_SIZE >= 65536)
+	if (len == (1 << 16))
+		return cpu_to_le16(EXT2_MAX_REC_LEN);
+	else
+		BUG_ON(len > (1 << 16));
+#endif
+	return cpu_to_le16(len);
+}
+
+/*
+ * NOTE! unlike strncmp, ext2_match returns 1 for success, 0 for failure.
+ *
+ * len <= EXT2_NAME_LEN and de != NULL are guaranteed by caller.
+ */
+static inline int ext2_match (int len, const char * const name,
+					struct ext2_dir_entry_2 * de)
+{
+	if (len != de->name_len)
+		return 0;
+	if (!de->inode)
+		return 0;
+	return !memcmp(name, de->name, len);
+}
+
+/*
+ * Scanning a linear directory compares the name against every entry, and
+ * nearly all of them differ in length or in the first few bytes.  A match
+ * key lays out the length and the first four bytes of the name the way
+ * they sit in a dirent, so one 64-bit load from rec_len up to name[3] -
+ * always inside the smallest entry - turns those away without touching
+ * the rest of the name.  Where such loads are not cheap, the key just
+ * holds the name and ext2_match() does the work.
+ */
+struct ext2_match_key {
+	const char	*name;
+	int		len;
+#if defined(CONFIG_64BIT) && defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS)
+	u64		word;
+	u64		mask;
+#endif
+};
+
+static inline void ext2_match_key_init(struct ext2_match_key *k,
+				       const char *name, int len)
+{
+	k->name = name;
+	k->len = len;
+#if defined(CONFIG_64BIT) && defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS)
+	{
+		int i;
+
+		/* byte 2 is name_len, bytes 4-7 are name[0-3] */
+		k->word = (u64)len << 16;
+		k->mask = 0xffULL << 16;
+		for (i = 0; i < min(len, 4); i++) {
+			k->word |= (u64)(u8)name[i] << (32 + 8 * i);
+			k->mask |= 0xffULL << (32 + 8 * i);
+		}
+	}
+#endif
+}
+
+/*
+ * Same as ext2_match().  The caller guarantees that at least
+ * EXT2_DIR_REC_LEN(k->len) bytes of the block follow de.
+ */
+static inline int ext2_match_key(const struct ext2_match_key *k,
+				 struct ext2_dir_entry_2 *de)
+{
+#if defined(CONFIG_64BIT) && defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS)
+	if ((get_unaligned_le64(&de->rec_len) & k->mask) != k->word)
+		return 0;
+	if (!de->inode)
+		return 0;
+	return k->len <= 4 || !memcmp(k->name + 4, de->name + 4, k->len - 4);
+#else
+	return ext2_match(k->len, k->name, de);
+#endif
+}
+
+/*
+ * p is at least 6 bytes before the end of page
+ */
+static inline struct ext2_dir_entry_2 *
+ext2_next_entry(struct ext2_dir_entry_2 *p)
+{
+	return (struct ext2_dir_entry_2 *)((char *)p +
+			ext2_rec_len_from_disk(p->rec_len));
+}
+
+/*
+ * Hash versions for indexed directories (s_def_hash_version and the
+ * hash_version of each dx_root).  The unsigned variants are never stored
+ * on disk; they are selected by EXT2_FLAGS_UNSIGNED_HASH.
+ */
+#define EXT2_DX_HASH_LEGACY		0
+#define EXT2_DX_HASH_HALF_MD4		1
+#define EXT2_DX_HASH_TEA		2
+#define EXT2_DX_HASH_LEGACY_UNSIGNED	3
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED	4
+#define EXT2_DX_HASH_TEA_UNSIGNED	5
+
+#define EXT2_HTREE_EOF_32BIT		0x7fffffff
+
+struct ext2_dx_hash_info {
+	u32	hash;
+	u32	minor_hash;
+	int	hash_version;
+	u32	*seed;
+};
+
 static inline void verify_offsets(void)
 {
 #define A(x,y) BUILD_BUG_ON(x != offsetof(struct ext2_super_block, y));
@@ -656,6 +1028,52 @@ struct ext2_inode_info {
 	struct ext2_block_alloc_info *i_block_alloc_info;
 
 	__u32	i_dir_start_lookup;
+
+	/*
+	 * Inode most recently allocated for an entry of this directory, or 0.
+	 * Siblings are placed right after it, so that they share inode table
+	 * blocks.  Only a hint: read and written without locking.
+	 */
+	unsigned long i_last_alloc_ino;
+
+	/*
+	 * Inodes [i_pool_next, i_pool_end) of group i_pool_group, taken in
+	 * the bitmap ahead of time for new files in this directory.  On
+	 * s_ino_pools while not empty.  Protected by s_ino_pool_lock.
+	 */
+	struct list_head i_pool_list;
+	unsigned long i_pool_group;
+	unsigned int i_pool_next, i_pool_end;
+
+	/*
+	 * Name hash of a linear directory (dir_cache.c) and the last name
+	 * a lookup found absent.  Both are protected by i_dir_cache_lock.
+	 */
+	spinlock_t i_dir_cache_lock;
+	struct ext2_dir_cache *i_dir_cache;
+	struct dentry *i_neg_dentry;
+	u64	i_neg_hash_len;
+	u64	i_neg_version;
+
+	/*
+	 * Largest free slot in each page of a linear directory, or
+	 * EXT2_GAP_UNKNOWN.  Only used under the directory's i_rwsem held
+	 * exclusively.
+	 */
+	u16	*i_dir_gaps;
+	unsigned long i_dir_gaps_nr;
+
+	/*
+	 * Live entries in a directory, "." and ".." included, or -1 if not
+	 * known yet.  Changed under the directory's i_rwsem held exclusively,
+	 * or set under it held shared by a readdir that saw every entry.
+	 */
+	long	i_dir_entries;
+
+	/* on s_compact_list while queued for background compaction */
+	struct list_head i_compact;
+	/* open files of a directory, each of which may hold a readdir position */
+	atomic_t i_dir_openers;
 #ifdef CONFIG_EXT2_FS_XATTR
 	/*
 	 * Extended attributes can be read independently of the main file
@@ -675,6 +1093,17 @@ struct ext2_inode_info {
 	 * ext2_reserve_window_node.
 	 */
 	struct mutex truncate_mutex;
+
+	/*
+	 * Asynchronous extending direct writes still in flight, sorted by
+	 * file offset.  i_size is only moved past a write once every write
+	 * below it has completed, so blocks that were allocated but not yet
+	 * written are never exposed.  i_dio_limit caps i_size after a failed
+	 * write whose blocks could not be zeroed.  Protected by i_dio_lock.
+	 */
+	spinlock_t i_dio_lock;
+	struct list_head i_dio_extends;
+	loff_t i_dio_limit;
 	struct inode	vfs_inode;
 	struct list_head i_orphan;	/* unlinked but open inodes */
 #ifdef CONFIG_QUOTA
@@ -682,10 +1111,27 @@ struct ext2_inode_info {
 #endif
 };
 
+/*
+ * Blocks queued for freeing by truncate.  All runs belong to fb_group and are
+ * released with a single bitmap and group descriptor update.
+ */
+#define EXT2_FREE_BATCH		32
+
+struct ext2_free_batch {
+	struct inode	*fb_inode;
+	unsigned long	fb_group;
+	int		fb_nr;
+	ext2_grpblk_t	fb_start[EXT2_FREE_BATCH];	/* offsets in group */
+	ext2_grpblk_t	fb_count[EXT2_FREE_BATCH];
+};
+
+#define EXT2_GAP_UNKNOWN	0xffff
+
 /*
  * Inode dynamic state flags
  */
 #define EXT2_STATE_NEW			0x00000001 /* inode is newly created */
+#define EXT2_STATE_ORPHAN		0x00000002 /* queued for deferred free */
 
 
 /*
@@ -710,13 +1156,28 @@ extern ext2_fsblk_t ext2_new_blocks(struct inode *, ext2_fsblk_t,
 extern int ext2_data_block_valid(struct ext2_sb_info *sbi, ext2_fsblk_t start_blk,
 				 unsigned int count);
 extern void ext2_free_blocks(struct inode *, ext2_fsblk_t, unsigned long);
+extern void ext2_free_batch_add(struct ext2_free_batch *fb, ext2_fsblk_t block,
+				unsigned long count);
+extern void ext2_free_batch_flush(struct ext2_free_batch *fb);
 extern unsigned long ext2_count_free_blocks (struct super_block *);
-extern unsigned long ext2_count_dirs (struct super_block *);
 extern struct ext2_group_desc * ext2_get_group_desc(struct super_block * sb,
 						    unsigned int block_group,
 						    struct buffer_head ** bh);
+extern struct ext2_group_desc *ext2_peek_group_desc(struct super_block *sb,
+						   unsigned int block_group,
+						   struct buffer_head **bh);
+extern void ext2_group_desc_csum_set(struct super_block *sb,
+				     unsigned int block_group,
+				     struct ext2_group_desc *desc);
+extern int ext2_group_desc_csum_verify(struct super_block *sb,
+				       unsigned int block_group,
+				       struct ext2_group_desc *desc);
 extern void ext2_discard_reservation (struct inode *);
 extern int ext2_should_retry_alloc(struct super_block *sb, int *retries);
+extern void ext2_discard_work(struct work_struct *work);
+extern void ext2_flush_discards(struct super_block *sb);
+extern int ext2_trim_fs(struct super_block *sb, struct fstrim_range *range);
+extern int ext2_fs_fragstat(struct super_block *sb, struct ext2_fragstat *fr);
 extern void ext2_init_block_alloc_info(struct inode *);
 extern void ext2_rsv_window_add(struct super_block *sb, struct ext2_reserve_window_node *rsv);
 
@@ -732,18 +1193,101 @@ int ext2_empty_dir(struct inode *);
 struct ext2_dir_entry_2 *ext2_dotdot(struct inode *dir, struct folio **foliop);
 int ext2_set_link(struct inode *dir, struct ext2_dir_entry_2 *de,
 		struct folio *folio, struct inode *inode, bool update_times);
+void *ext2_get_folio(struct inode *dir, unsigned long n, int quiet,
+		struct folio **foliop);
+unsigned ext2_last_byte(struct inode *inode, unsigned long page_nr);
+void ext2_dir_readahead(struct inode *dir, struct file_ra_state *ra,
+		struct file *file, unsigned long n, unsigned long npages);
+int ext2_prepare_chunk(struct folio *folio, loff_t pos, unsigned len);
+void ext2_commit_chunk(struct folio *folio, loff_t pos, unsigned len);
+int ext2_insert_entry(struct inode *dir, struct folio *folio,
+		struct ext2_dir_entry_2 *de, const struct qstr *name,
+		struct inode *inode);
+void ext2_note_negative(struct inode *dir, struct dentry *dentry);
+void ext2_dir_gaps_drop(struct inode *dir);
+int ext2_compact_dir(struct inode *dir, struct file *file);
+void ext2_compact_del(struct inode *dir);
+void ext2_compact_work(struct work_struct *work);
+int ext2_bulkstat(struct file *file, struct ext2_bulkstat *bs);
+
+/* bitmap_cache.c */
+struct buffer_head *ext2_bitmap_cache_get(struct super_block *sb,
+		unsigned int group, int type);
+void ext2_bitmap_cache_add(struct super_block *sb, unsigned int group,
+		int type, struct buffer_head *bh);
+int ext2_init_bitmap_cache(struct super_block *sb);
+void ext2_destroy_bitmap_cache(struct super_block *sb);
+
+/* dir_cache.c */
+struct ext2_dir_entry_2 *ext2_dir_cache_find(struct inode *dir,
+		const struct qstr *child, struct folio **foliop);
+void ext2_dir_cache_add(struct inode *dir, const char *name, int len,
+		loff_t pos);
+void ext2_dir_cache_del(struct inode *dir, const char *name, int len,
+		loff_t pos);
+void ext2_dir_cache_drop(struct inode *dir);
+int ext2_init_dir_cache(void);
+void ext2_exit_dir_cache(void);
+
+/* dir_index.c */
+struct ext2_dir_entry_2 *ext2_dx_find_entry(struct inode *dir,
+		const struct qstr *child, struct folio **foliop);
+int ext2_dx_add_link(struct dentry *dentry, struct inode *inode);
+int ext2_dx_make_indexed(struct dentry *dentry, struct inode *inode);
+
+static inline bool ext2_dx_enabled(struct inode *dir)
+{
+	return EXT2_HAS_COMPAT_FEATURE(dir->i_sb,
+				       EXT2_FEATURE_COMPAT_DIR_INDEX);
+}
+
+static inline bool ext2_dx_indexed(struct inode *dir)
+{
+	return ext2_dx_enabled(dir) &&
+	       (EXT2_I(dir)->i_flags & EXT2_INDEX_FL);
+}
+
+/* hash.c */
+extern int ext2_dirhash(const char *name, int len,
+			struct ext2_dx_hash_info *hinfo);
 
 /* ialloc.c */
 extern struct inode * ext2_new_inode (struct inode *, umode_t, const struct qstr *);
 extern void ext2_free_inode (struct inode *);
 extern unsigned long ext2_count_free_inodes (struct super_block *);
 extern unsigned long ext2_count_free (struct buffer_head *, unsigned);
+extern void ext2_inode_readahead(struct super_block *sb, unsigned long *inos,
+				 int nr);
+extern int ext2_init_group_info(struct super_block *sb);
+extern void ext2_ino_pool_drop(struct inode *dir);
+extern void ext2_flush_ino_pools(struct super_block *sb);
+extern void ext2_group_info_update(struct super_block *sb, int group,
+				   struct ext2_group_desc *desc);
+extern int ext2_init_inode_deltas(struct super_block *sb);
+extern void ext2_itable_work(struct work_struct *work);
+extern void ext2_start_itable_init(struct super_block *sb);
+extern void ext2_fold_inode_deltas(struct super_block *sb);
+
+/* file.c */
+extern loff_t ext2_dio_extend_end(struct inode *inode);
+
+static inline bool ext2_dio_extends_pending(struct inode *inode)
+{
+	return !list_empty_careful(&EXT2_I(inode)->i_dio_extends);
+}
 
 /* inode.c */
 extern struct inode *ext2_iget (struct super_block *, unsigned long);
 extern int ext2_write_inode (struct inode *, struct writeback_control *);
 extern void ext2_evict_inode(struct inode *);
 void ext2_write_failed(struct address_space *mapping, loff_t to);
+extern int ext2_drop_inode(struct inode *inode);
+extern void ext2_orphan_work(struct work_struct *work);
+extern void ext2_flush_orphans(struct super_block *sb);
+extern void ext2_shrink_blocks(struct inode *inode, loff_t newsize);
+extern bool ext2_dio_overwrite(struct inode *inode, loff_t pos, size_t len);
+extern int ext2_zero_mapped_range(struct inode *inode, loff_t start,
+				  loff_t end);
 extern int ext2_get_block(struct inode *, sector_t, struct buffer_head *, int);
 extern int ext2_setattr (struct mnt_idmap *, struct dentry *, struct iattr *);
 extern int ext2_getattr (struct mnt_idmap *, const struct path *,
@@ -751,6 +1295,8 @@ extern int ext2_getattr (struct mnt_idmap *, const struct path *,
 extern void ext2_set_inode_flags(struct inode *inode);
 extern int ext2_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		       u64 start, u64 len);
+extern int ext2_defrag(struct inode *inode, struct ext2_defrag *df);
+extern int ext2_file_fragstat(struct inode *inode, struct ext2_fragstat *fr);
 
 /* ioctl.c */
 extern int ext2_fileattr_get(struct dentry *dentry, struct fileattr *fa);
@@ -761,6 +1307,7 @@ extern long ext2_compat_ioctl(struct file *, unsigned int, unsigned long);
 
 /* namei.c */
 struct dentry *ext2_get_parent(struct dentry *child);
+extern time64_t ext2_creation_time(struct inode *inode);
 
 /* super.c */
 extern __printf(3, 4)
@@ -770,6 +1317,8 @@ void ext2_msg(struct super_block *, const char *, const char *, ...);
 extern void ext2_update_dynamic_rev (struct super_block *sb);
 extern void ext2_sync_super(struct super_block *sb, struct ext2_super_block *es,
 			    int wait);
+extern int ext2_load_group_desc(struct super_block *sb, unsigned long nr);
+extern void ext2_load_group_descs(struct super_block *sb);
 
 /*
  * Inodes and files operations
@@ -797,6 +1346,16 @@ extern const struct inode_operations ext2_special_inode_operations;
 extern const struct inode_operations ext2_fast_symlink_inode_operations;
 extern const struct inode_operations ext2_symlink_inode_operations;
 
+static inline bool ext2_orphans_pending(struct super_block *sb)
+{
+	return !list_empty_careful(&EXT2_SB(sb)->s_orphan_list);
+}
+
+static inline bool ext2_discards_pending(struct super_block *sb)
+{
+	return READ_ONCE(EXT2_SB(sb)->s_discard_blocks) != 0;
+}
+
 static inline ext2_fsblk_t
 ext2_group_first_block_no(struct super_block *sb, unsigned long group_no)
 {
@@ -822,4 +1381,5 @@ unsigned long ext2_check_free_space(struct super_block *sb);
 #define ext2_test_bit	test_bit_le
 #define ext2_find_first_zero_bit	find_first_zero_bit_le
 #define ext2_find_next_zero_bit		find_next_zero_bit_le
+#define ext2_find_next_bit		find_next_bit_le
 #endif /* _LINUX_EXT2_H */
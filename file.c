@@ -26,6 +26,7 @@
 #include <linux/iomap.h>
 #include <linux/uio.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
 #include "ext2.h"
 #include "xattr.h"
 #include "acl.h"
@@ -179,12 +180,166 @@ static ssize_t ext2_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
 	return ret;
 }
 
+/*
+ * An asynchronous extending direct write.  These are queued on
+ * ei->i_dio_extends in file offset order when they are submitted and retired
+ * from the head of the list as they complete, so i_size only ever grows over
+ * a range once everything below it has hit the disk.
+ */
+struct ext2_dio_extend {
+	struct list_head	list;
+	struct kiocb		*iocb;
+	loff_t			start;
+	loff_t			end;
+	bool			done;
+};
+
+static struct ext2_dio_extend *ext2_dio_extend_find(struct ext2_inode_info *ei,
+						    struct kiocb *iocb)
+{
+	struct ext2_dio_extend *de;
+
+	list_for_each_entry(de, &ei->i_dio_extends, list)
+		if (de->iocb == iocb)
+			return de;
+	return NULL;
+}
+
+/*
+ * Highest offset covered by an asynchronous extending write in flight.
+ * Blocks below it must not be trimmed by ext2_write_failed().
+ */
+loff_t ext2_dio_extend_end(struct inode *inode)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	struct ext2_dio_extend *de;
+	loff_t end = 0;
+
+	spin_lock(&ei->i_dio_lock);
+	list_for_each_entry(de, &ei->i_dio_extends, list)
+		end = max(end, de->end);
+	spin_unlock(&ei->i_dio_lock);
+	return end;
+}
+
+/*
+ * Retire completed writes from the head of the list and move i_size over
+ * them.  Returns true if i_size changed.  Called with i_dio_lock held.
+ */
+static bool ext2_dio_extend_advance(struct inode *inode)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	struct ext2_dio_extend *de, *tmp;
+	loff_t size = i_size_read(inode);
+
+	list_for_each_entry_safe(de, tmp, &ei->i_dio_extends, list) {
+		if (!de->done)
+			break;
+		size = max(size, min(de->end, ei->i_dio_limit));
+		list_del(&de->list);
+		kfree(de);
+	}
+	if (size <= i_size_read(inode))
+		return false;
+	i_size_write(inode, size);
+	return true;
+}
+
+static struct ext2_dio_extend *ext2_dio_extend_start(struct inode *inode,
+				struct kiocb *iocb, size_t count)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	struct ext2_dio_extend *de, *pos;
+
+	de = kmalloc(sizeof(*de), GFP_NOFS);
+	if (!de)
+		return NULL;
+	de->iocb = iocb;
+	de->start = iocb->ki_pos;
+	de->end = iocb->ki_pos + count;
+	de->done = false;
+
+	spin_lock(&ei->i_dio_lock);
+	list_for_each_entry_reverse(pos, &ei->i_dio_extends, list)
+		if (pos->start <= de->start)
+			break;
+	list_add(&de->list, &pos->list);
+	spin_unlock(&ei->i_dio_lock);
+	return de;
+}
+
+/*
+ * Called by the submitter once iomap_dio_rw() has returned anything but
+ * -EIOCBQUEUED.  If ->end_io never ran (the write failed before any I/O was
+ * issued) the entry is still queued and has to be retired here.
+ */
+static void ext2_dio_extend_cancel(struct inode *inode, struct kiocb *iocb)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	struct ext2_dio_extend *de;
+	bool dirty = false;
+
+	spin_lock(&ei->i_dio_lock);
+	de = ext2_dio_extend_find(ei, iocb);
+	if (de) {
+		de->end = de->start;
+		de->done = true;
+		dirty = ext2_dio_extend_advance(inode);
+	}
+	spin_unlock(&ei->i_dio_lock);
+	if (dirty)
+		mark_inode_dirty(inode);
+}
+
+/*
+ * Completion of an asynchronous extending write.  Whatever part of the range
+ * was not written has had its blocks allocated already, so zero them before
+ * letting i_size cover them.  Returns false if @iocb was not tracked.
+ */
+static bool ext2_dio_extend_done(struct inode *inode, struct kiocb *iocb,
+				 ssize_t size, int error)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	struct ext2_dio_extend *de;
+	loff_t zero_from, limit = LLONG_MAX;
+	bool dirty;
+
+	spin_lock(&ei->i_dio_lock);
+	de = ext2_dio_extend_find(ei, iocb);
+	spin_unlock(&ei->i_dio_lock);
+	if (!de)
+		return false;
+
+	zero_from = error ? de->start : de->start + size;
+	if (zero_from < de->end &&
+	    ext2_zero_mapped_range(inode, zero_from, de->end)) {
+		ext2_error(inode->i_sb, __func__,
+			   "cannot clear blocks of failed direct write "
+			   "to inode %lu", inode->i_ino);
+		limit = max(zero_from, i_size_read(inode));
+	}
+
+	spin_lock(&ei->i_dio_lock);
+	ei->i_dio_limit = min(ei->i_dio_limit, limit);
+	de->end = min(de->end, zero_from);
+	de->done = true;
+	dirty = ext2_dio_extend_advance(inode);
+	spin_unlock(&ei->i_dio_lock);
+	if (dirty)
+		mark_inode_dirty(inode);
+	return true;
+}
+
 static int ext2_dio_write_end_io(struct kiocb *iocb, ssize_t size,
 				 int error, unsigned int flags)
 {
 	loff_t pos = iocb->ki_pos;
 	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	bool dirty = false;
 
+	if (ext2_dio_extend_done(inode, iocb, size, error))
+		goto out;
 	if (error)
 		goto out;
 
@@ -192,15 +347,21 @@ static int ext2_dio_write_end_io(struct kiocb *iocb, ssize_t size,
 	 * If we are extending the file, we have to update i_size here before
 	 * page cache gets invalidated in iomap_dio_rw(). This prevents racing
 	 * buffered reads from zeroing out too much from page cache pages.
-	 * Note that all extending writes always happens synchronously with
-	 * inode lock held by ext2_dio_write_iter(). So it is safe to update
-	 * inode size here for extending file writes.
+	 * Extending writes that are not tracked on i_dio_extends are
+	 * synchronous and only issued once all tracked ones have drained, so
+	 * a plain update is enough; i_dio_lock keeps it from racing with the
+	 * completion of asynchronous ones.
 	 */
 	pos += size;
+	spin_lock(&ei->i_dio_lock);
+	pos = min(pos, ei->i_dio_limit);
 	if (pos > i_size_read(inode)) {
 		i_size_write(inode, pos);
-		mark_inode_dirty(inode);
+		dirty = true;
 	}
+	spin_unlock(&ei->i_dio_lock);
+	if (dirty)
+		mark_inode_dirty(inode);
 out:
 	trace_ext2_dio_write_endio(iocb, size, error);
 	return error;
@@ -210,6 +371,55 @@ static const struct iomap_dio_ops ext2_dio_write_ops = {
 	.end_io = ext2_dio_write_end_io,
 };
 
+/*
+ * Block aligned direct writes that only overwrite blocks which are already
+ * allocated need neither block allocation nor an i_size update, so they run
+ * under the shared inode lock and in parallel with each other.  Returns true
+ * if the write was done here, with the result in *retp.
+ */
+static bool ext2_dio_overwrite_iter(struct kiocb *iocb, struct iov_iter *from,
+				    ssize_t *retp)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned long blocksize = inode->i_sb->s_blocksize;
+	ssize_t ret;
+
+	if ((iocb->ki_flags & IOCB_APPEND) || !IS_NOSEC(inode) ||
+	    !IS_ALIGNED(iocb->ki_pos | iov_iter_alignment(from), blocksize) ||
+	    iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))
+		return false;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return false;
+	} else {
+		inode_lock_shared(inode);
+	}
+
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_done;
+	if (!IS_NOSEC(inode) ||
+	    !ext2_dio_overwrite(inode, iocb->ki_pos, iov_iter_count(from)))
+		goto out_fallback;
+	ret = kiocb_modified(iocb);
+	if (ret)
+		goto out_done;
+
+	ret = iomap_dio_rw(iocb, from, &ext2_iomap_ops, &ext2_dio_write_ops,
+			   IOMAP_DIO_OVERWRITE_ONLY, NULL, 0);
+	/* the mapping changed under us, retry with the exclusive lock */
+	if (ret == -EAGAIN && !(iocb->ki_flags & IOCB_NOWAIT))
+		goto out_fallback;
+out_done:
+	inode_unlock_shared(inode);
+	*retp = ret;
+	return true;
+out_fallback:
+	inode_unlock_shared(inode);
+	return false;
+}
+
 static ssize_t ext2_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	struct file *file = iocb->ki_filp;
@@ -217,12 +427,23 @@ static ssize_t ext2_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	ssize_t ret;
 	unsigned int flags = 0;
 	unsigned long blocksize = inode->i_sb->s_blocksize;
-	loff_t offset = iocb->ki_pos;
-	loff_t count = iov_iter_count(from);
+	loff_t offset;
+	loff_t count;
 	ssize_t status = 0;
+	struct ext2_dio_extend *de = NULL;
+	bool extend, unaligned;
 
 	trace_ext2_dio_write_begin(iocb, from, 0);
+	if (ext2_dio_overwrite_iter(iocb, from, &ret))
+		goto out;
+
 	inode_lock(inode);
+	/*
+	 * i_size lags behind asynchronous extending writes, so appending
+	 * writers have to wait for them to learn where the file ends.
+	 */
+	if ((iocb->ki_flags & IOCB_APPEND) && ext2_dio_extends_pending(inode))
+		inode_dio_wait(inode);
 	ret = generic_write_checks(iocb, from);
 	if (ret <= 0)
 		goto out_unlock;
@@ -231,13 +452,31 @@ static ssize_t ext2_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	if (ret)
 		goto out_unlock;
 
-	/* use IOMAP_DIO_FORCE_WAIT for unaligned or extending writes */
-	if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode) ||
-	   (!IS_ALIGNED(iocb->ki_pos | iov_iter_alignment(from), blocksize)))
+	offset = iocb->ki_pos;
+	count = iov_iter_count(from);
+	extend = offset + count > i_size_read(inode);
+	unaligned = !IS_ALIGNED(offset | iov_iter_alignment(from), blocksize);
+
+	/*
+	 * Block aligned extending AIO completes asynchronously and has i_size
+	 * updated from ->end_io.  Unaligned writes need sub-block zeroing and
+	 * O_DSYNC writes must find i_size on disk when they complete, so both
+	 * still wait; extending ones also wait for the asynchronous ones ahead
+	 * of them so that i_size is never moved over unwritten blocks.
+	 */
+	if (extend && !unaligned && !is_sync_kiocb(iocb) &&
+	    !(iocb->ki_flags & IOCB_DSYNC))
+		de = ext2_dio_extend_start(inode, iocb, count);
+	if (!de && (extend || unaligned)) {
 		flags |= IOMAP_DIO_FORCE_WAIT;
+		if (extend && ext2_dio_extends_pending(inode))
+			inode_dio_wait(inode);
+	}
 
 	ret = iomap_dio_rw(iocb, from, &ext2_iomap_ops, &ext2_dio_write_ops,
 			   flags, NULL, 0);
+	if (de && ret != -EIOCBQUEUED)
+		ext2_dio_extend_cancel(inode, iocb);
 
 	/* ENOTBLK is magic return value for fallback to buffered-io */
 	if (ret == -ENOTBLK)
@@ -251,6 +490,8 @@ static ssize_t ext2_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
 		loff_t pos, endbyte;
 		int ret2;
 
+		if (ext2_dio_extends_pending(inode))
+			inode_dio_wait(inode);
 		iocb->ki_flags &= ~IOCB_DIRECT;
 		pos = iocb->ki_pos;
 		status = generic_perform_write(iocb, from);
@@ -275,10 +516,34 @@ out_unlock:
 	inode_unlock(inode);
 	if (status)
 		trace_ext2_dio_write_buff_end(iocb, from, status);
+out:
 	trace_ext2_dio_write_end(iocb, from, ret);
 	return ret;
 }
 
+/*
+ * Same as generic_file_write_iter(), except that buffered writes must not move
+ * i_size over blocks of asynchronous extending direct writes still in flight.
+ */
+static ssize_t ext2_buffered_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	inode_lock(inode);
+	if (ext2_dio_extends_pending(inode))
+		inode_dio_wait(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret > 0)
+		ret = __generic_file_write_iter(iocb, from);
+	inode_unlock(inode);
+
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
 static ssize_t ext2_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 #ifdef CONFIG_FS_DAX
@@ -300,7 +565,7 @@ static ssize_t ext2_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	if (iocb->ki_flags & IOCB_DIRECT)
 		return ext2_dio_write_iter(iocb, from);
 
-	return generic_file_write_iter(iocb, from);
+	return ext2_buffered_write_iter(iocb, from);
 }
 
 const struct file_operations ext2_file_operations = {
@@ -16,8 +16,9 @@
 #include <linux/quotaops.h>
 #include <linux/sched.h>
 #include <linux/backing-dev.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
-#include <linux/random.h>
+#include <linux/sort.h>
 #include "ext2.h"
 #include "xattr.h"
 #include "acl.h"
@@ -49,41 +50,218 @@ read_inode_bitmap(struct super_block * sb, unsigned long block_group)
 	struct ext2_group_desc *desc;
 	struct buffer_head *bh = NULL;
 
+	bh = ext2_bitmap_cache_get(sb, block_group, EXT2_INODE_BITMAP);
+	if (bh)
+		return bh;
 	desc = ext2_get_group_desc(sb, block_group, NULL);
 	if (!desc)
 		goto error_out;
 
+	/* never written: all free, as in read_block_bitmap() */
+	if (EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    (desc->bg_flags & cpu_to_le16(EXT2_BG_INODE_UNINIT))) {
+		bh = sb_getblk(sb, le32_to_cpu(desc->bg_inode_bitmap));
+		if (!bh)
+			goto error_out;
+		lock_buffer(bh);
+		if (!buffer_ext2_uninit(bh)) {
+			unsigned int bit;
+
+			memset(bh->b_data, 0, sb->s_blocksize);
+			for (bit = EXT2_INODES_PER_GROUP(sb);
+			     bit < sb->s_blocksize * 8; bit++)
+				ext2_set_bit(bit, bh->b_data);
+			set_buffer_uptodate(bh);
+			set_buffer_ext2_uninit(bh);
+		}
+		unlock_buffer(bh);
+		goto out;
+	}
+
 	bh = sb_bread(sb, le32_to_cpu(desc->bg_inode_bitmap));
-	if (!bh)
+	if (!bh) {
 		ext2_error(sb, "read_inode_bitmap",
 			    "Cannot read inode bitmap - "
 			    "block_group = %lu, inode_bitmap = %u",
 			    block_group, le32_to_cpu(desc->bg_inode_bitmap));
+		goto error_out;
+	}
+out:
+	ext2_bitmap_cache_add(sb, block_group, EXT2_INODE_BITMAP, bh);
 error_out:
 	return bh;
 }
 
-static void ext2_release_inode(struct super_block *sb, int group, int dir)
+/*
+ * The free inode and directory counts of a group, and its s_debts entry,
+ * change with every create and unlink.  Rather than bouncing the group lock
+ * and the descriptor block between CPUs for each of them, every CPU keeps
+ * what it changed in s_inode_deltas and adds it to the descriptor once it
+ * reaches EXT2_IDELTA_BATCH, when another group needs the slot, and from
+ * sync_fs and put_super.  s_idelta_work also adds everything no later than
+ * EXT2_IDELTA_DELAY after a change, so a descriptor reaches the disk with
+ * writeback of the bitmap it goes with, much as when it was changed in
+ * place.  The bitmaps stay exact, and the on-disk descriptors are current
+ * after a sync just as before; only find_group_*() works from counts that
+ * may be a few batches behind.  statfs adds what is pending instead.
+ *
+ * Lock order: group lock, then a CPU's s_inode_deltas lock.
+ */
+#define EXT2_IDELTA_BATCH	32
+#define EXT2_IDELTA_DELAY	(5 * HZ)
+
+static void ext2_idelta_work(struct work_struct *work)
+{
+	struct ext2_sb_info *sbi = container_of(to_delayed_work(work),
+					struct ext2_sb_info, s_idelta_work);
+	struct super_block *sb = sbi->s_sb;
+
+	/* freezing folds everything from sync_fs */
+	if (!sb_start_intwrite_trylock(sb))
+		return;
+	ext2_fold_inode_deltas(sb);
+	sb_end_intwrite(sb);
+}
+
+int ext2_init_inode_deltas(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	int cpu;
+
+	sbi->s_inode_deltas = alloc_percpu(struct ext2_inode_deltas);
+	if (!sbi->s_inode_deltas)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sbi->s_inode_deltas, cpu)->lock);
+	INIT_DELAYED_WORK(&sbi->s_idelta_work, ext2_idelta_work);
+	return 0;
+}
+
+/* Move what @cpu holds for @group into @free, @dirs and @debt. */
+static void ext2_take_inode_delta(struct ext2_sb_info *sbi, int cpu,
+				  unsigned int group, int *free, int *dirs,
+				  int *debt)
+{
+	struct ext2_inode_deltas *d = per_cpu_ptr(sbi->s_inode_deltas, cpu);
+	int i = group % EXT2_IDELTA_SLOTS;
+
+	spin_lock(&d->lock);
+	if (d->slot[i].group == group) {
+		*free += d->slot[i].free;
+		*dirs += d->slot[i].dirs;
+		*debt += d->slot[i].debt;
+		d->slot[i].free = d->slot[i].dirs = d->slot[i].debt = 0;
+	}
+	spin_unlock(&d->lock);
+}
+
+/*
+ * Add what @cpu holds for @group, plus @free, @dirs and @debt, to the group
+ * descriptor.  If that would take a count below zero, another CPU still
+ * holds frees of the inodes this one allocated, so take every CPU's share.
+ */
+static void ext2_fold_inode_delta(struct super_block *sb, unsigned int group,
+				  int cpu, int free, int dirs, int debt)
 {
-	struct ext2_group_desc * desc;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_desc *desc;
 	struct buffer_head *bh;
+	int i;
 
 	desc = ext2_get_group_desc(sb, group, &bh);
-	if (!desc) {
-		ext2_error(sb, "ext2_release_inode",
-			"can't get descriptor for group %d", group);
+	if (!desc)
+		return;
+
+	spin_lock(sb_bgl_lock(sbi, group));
+	ext2_take_inode_delta(sbi, cpu, group, &free, &dirs, &debt);
+	if (le16_to_cpu(desc->bg_free_inodes_count) + free < 0 ||
+	    le16_to_cpu(desc->bg_used_dirs_count) + dirs < 0) {
+		for_each_possible_cpu(i)
+			if (i != cpu)
+				ext2_take_inode_delta(sbi, i, group, &free,
+						      &dirs, &debt);
+	}
+	if (!free && !dirs && !debt) {
+		spin_unlock(sb_bgl_lock(sbi, group));
 		return;
 	}
+	le16_add_cpu(&desc->bg_free_inodes_count, free);
+	le16_add_cpu(&desc->bg_used_dirs_count, dirs);
+	ext2_group_desc_csum_set(sb, group, desc);
+	sbi->s_debts[group] = clamp(sbi->s_debts[group] + debt, 0, 255);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	ext2_group_info_update(sb, group, desc);
+	mark_buffer_dirty(bh);
+}
 
-	spin_lock(sb_bgl_lock(EXT2_SB(sb), group));
-	le16_add_cpu(&desc->bg_free_inodes_count, 1);
-	if (dir)
-		le16_add_cpu(&desc->bg_used_dirs_count, -1);
-	spin_unlock(sb_bgl_lock(EXT2_SB(sb), group));
+static void ext2_adjust_inode_counts(struct super_block *sb,
+				     unsigned int group, int free, int dirs,
+				     int debt)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_inode_deltas *d;
+	unsigned int victim = group;
+	bool fold = false;
+	int i = group % EXT2_IDELTA_SLOTS;
+	int cpu;
+
+	/* migrating away from @cpu is harmless, its slot is locked */
+	cpu = raw_smp_processor_id();
+	d = per_cpu_ptr(sbi->s_inode_deltas, cpu);
+	spin_lock(&d->lock);
+	if (d->slot[i].group != group && !d->slot[i].free &&
+	    !d->slot[i].dirs && !d->slot[i].debt)
+		d->slot[i].group = group;
+	if (d->slot[i].group == group) {
+		d->slot[i].free += free;
+		d->slot[i].dirs += dirs;
+		d->slot[i].debt += debt;
+		fold = abs(d->slot[i].free) >= EXT2_IDELTA_BATCH ||
+		       abs(d->slot[i].dirs) >= EXT2_IDELTA_BATCH ||
+		       abs(d->slot[i].debt) >= EXT2_IDELTA_BATCH;
+		free = dirs = debt = 0;
+	} else {
+		victim = d->slot[i].group;
+	}
+	spin_unlock(&d->lock);
+
+	if (victim != group) {
+		/* slot taken by another group: hand it back, apply ours now */
+		ext2_fold_inode_delta(sb, victim, cpu, 0, 0, 0);
+		ext2_fold_inode_delta(sb, group, cpu, free, dirs, debt);
+	} else if (fold) {
+		ext2_fold_inode_delta(sb, group, cpu, 0, 0, 0);
+	} else if (!delayed_work_pending(&sbi->s_idelta_work)) {
+		queue_delayed_work(system_unbound_wq, &sbi->s_idelta_work,
+				   EXT2_IDELTA_DELAY);
+	}
+}
+
+/* Bring every group descriptor up to date. */
+void ext2_fold_inode_deltas(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_inode_deltas *d;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		d = per_cpu_ptr(sbi->s_inode_deltas, cpu);
+		for (i = 0; i < EXT2_IDELTA_SLOTS; i++)
+			if (READ_ONCE(d->slot[i].free) ||
+			    READ_ONCE(d->slot[i].dirs) ||
+			    READ_ONCE(d->slot[i].debt))
+				ext2_fold_inode_delta(sb,
+					READ_ONCE(d->slot[i].group), cpu,
+					0, 0, 0);
+	}
+}
+
+static void ext2_release_inode(struct super_block *sb, int group, int dir)
+{
+	ext2_adjust_inode_counts(sb, group, 1, dir ? -1 : 0, 0);
 	percpu_counter_inc(&EXT2_SB(sb)->s_freeinodes_counter);
 	if (dir)
 		percpu_counter_dec(&EXT2_SB(sb)->s_dirs_counter);
-	mark_buffer_dirty(bh);
 }
 
 /*
@@ -152,6 +330,136 @@ void ext2_free_inode (struct inode * inode)
 	brelse(bitmap_bh);
 }
 
+/*
+ * With -o inode_pool, a new file takes the free inodes that follow its own
+ * in the bitmap, up to EXT2_INO_POOL in all, for the next files of the same
+ * directory.  Those are then handed out without touching the bitmap, the
+ * group descriptor or the free inodes counter again.  What is left over
+ * goes back when the directory is evicted and on sync, so it is only ever
+ * lost to a crash, and e2fsck gets it back.
+ */
+#define EXT2_INO_POOL	32
+
+static void ext2_ino_pool_return(struct super_block *sb, unsigned long group,
+				 unsigned int first, unsigned int end)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct buffer_head *bitmap_bh;
+	unsigned int bit, freed = 0;
+
+	bitmap_bh = read_inode_bitmap(sb, group);
+	if (!bitmap_bh)
+		return;
+	for (bit = first; bit < end; bit++) {
+		if (ext2_clear_bit_atomic(sb_bgl_lock(sbi, group), bit,
+					  bitmap_bh->b_data))
+			freed++;
+		else
+			ext2_error(sb, __func__,
+				   "bit already cleared for inode %lu",
+				   group * EXT2_INODES_PER_GROUP(sb) + bit + 1);
+	}
+	mark_buffer_dirty(bitmap_bh);
+	brelse(bitmap_bh);
+
+	ext2_adjust_inode_counts(sb, group, freed, 0, 0);
+	percpu_counter_add(&sbi->s_freeinodes_counter, freed);
+}
+
+/* Next inode from the pool of @dir, or 0 if it is empty. */
+static unsigned long ext2_ino_pool_take(struct inode *dir, int *group)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	unsigned long ino = 0;
+
+	if (list_empty_careful(&ei->i_pool_list))
+		return 0;
+	spin_lock(&sbi->s_ino_pool_lock);
+	if (ei->i_pool_next < ei->i_pool_end) {
+		*group = ei->i_pool_group;
+		ino = ei->i_pool_group * EXT2_INODES_PER_GROUP(dir->i_sb) +
+		      ei->i_pool_next++ + 1;
+		sbi->s_pooled_inodes--;
+		if (ei->i_pool_next == ei->i_pool_end)
+			list_del_init(&ei->i_pool_list);
+	}
+	spin_unlock(&sbi->s_ino_pool_lock);
+	return ino;
+}
+
+static void ext2_ino_pool_fill(struct inode *dir, unsigned long group,
+			       unsigned int first, unsigned int end)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	struct ext2_inode_info *ei = EXT2_I(dir);
+
+	spin_lock(&sbi->s_ino_pool_lock);
+	if (ei->i_pool_next == ei->i_pool_end) {
+		ei->i_pool_group = group;
+		ei->i_pool_next = first;
+		ei->i_pool_end = end;
+		sbi->s_pooled_inodes += end - first;
+		list_add_tail(&ei->i_pool_list, &sbi->s_ino_pools);
+		first = end;
+	}
+	spin_unlock(&sbi->s_ino_pool_lock);
+	/* lost a race with another create in this directory */
+	if (first < end)
+		ext2_ino_pool_return(dir->i_sb, group, first, end);
+}
+
+/* Detach the pool of @ei for returning it.  Called under s_ino_pool_lock. */
+static void ext2_ino_pool_detach(struct ext2_sb_info *sbi,
+				 struct ext2_inode_info *ei,
+				 unsigned long *group, unsigned int *first,
+				 unsigned int *end)
+{
+	*group = ei->i_pool_group;
+	*first = ei->i_pool_next;
+	*end = ei->i_pool_end;
+	sbi->s_pooled_inodes -= *end - *first;
+	ei->i_pool_next = ei->i_pool_end;
+	list_del_init(&ei->i_pool_list);
+}
+
+void ext2_ino_pool_drop(struct inode *dir)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	unsigned long group;
+	unsigned int first, end;
+
+	if (list_empty_careful(&EXT2_I(dir)->i_pool_list))
+		return;
+	spin_lock(&sbi->s_ino_pool_lock);
+	if (list_empty(&EXT2_I(dir)->i_pool_list)) {
+		spin_unlock(&sbi->s_ino_pool_lock);
+		return;
+	}
+	ext2_ino_pool_detach(sbi, EXT2_I(dir), &group, &first, &end);
+	spin_unlock(&sbi->s_ino_pool_lock);
+	ext2_ino_pool_return(dir->i_sb, group, first, end);
+}
+
+/* Put every pooled inode back in the bitmaps. */
+void ext2_flush_ino_pools(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_inode_info *ei;
+	unsigned long group;
+	unsigned int first, end;
+
+	spin_lock(&sbi->s_ino_pool_lock);
+	while ((ei = list_first_entry_or_null(&sbi->s_ino_pools,
+				struct ext2_inode_info, i_pool_list))) {
+		ext2_ino_pool_detach(sbi, ei, &group, &first, &end);
+		spin_unlock(&sbi->s_ino_pool_lock);
+		ext2_ino_pool_return(sb, group, first, end);
+		spin_lock(&sbi->s_ino_pool_lock);
+	}
+	spin_unlock(&sbi->s_ino_pool_lock);
+}
+
 /*
  * We perform asynchronous prereading of the new inode's inode block when
  * we create the inode, in the expectation that the inode will be written
@@ -164,26 +472,75 @@ void ext2_free_inode (struct inode * inode)
  *
  * FIXME: ext2_get_group_desc() needs to be simplified.
  */
-static void ext2_preread_inode(struct inode *inode)
+/*
+ * Block of the inode table holding inode @ino, or 0 if its group
+ * descriptor can't be had.
+ */
+static ext2_fsblk_t ext2_inode_table_block(struct super_block *sb,
+					   unsigned long ino)
 {
 	unsigned long block_group;
 	unsigned long offset;
-	unsigned long block;
 	struct ext2_group_desc * gdp;
 
-	block_group = (inode->i_ino - 1) / EXT2_INODES_PER_GROUP(inode->i_sb);
-	gdp = ext2_get_group_desc(inode->i_sb, block_group, NULL);
+	block_group = (ino - 1) / EXT2_INODES_PER_GROUP(sb);
+	gdp = ext2_get_group_desc(sb, block_group, NULL);
 	if (gdp == NULL)
-		return;
+		return 0;
 
 	/*
 	 * Figure out the offset within the block group inode table
 	 */
-	offset = ((inode->i_ino - 1) % EXT2_INODES_PER_GROUP(inode->i_sb)) *
-				EXT2_INODE_SIZE(inode->i_sb);
-	block = le32_to_cpu(gdp->bg_inode_table) +
-				(offset >> EXT2_BLOCK_SIZE_BITS(inode->i_sb));
-	sb_breadahead(inode->i_sb, block);
+	offset = ((ino - 1) % EXT2_INODES_PER_GROUP(sb)) * EXT2_INODE_SIZE(sb);
+	return le32_to_cpu(gdp->bg_inode_table) +
+				(offset >> EXT2_BLOCK_SIZE_BITS(sb));
+}
+
+static void ext2_preread_inode(struct inode *inode)
+{
+	ext2_fsblk_t block = ext2_inode_table_block(inode->i_sb, inode->i_ino);
+
+	if (block)
+		sb_breadahead(inode->i_sb, block);
+}
+
+static int ext2_cmp_block(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Start reading the inode table blocks behind the @nr inode numbers in
+ * @inos, which is overwritten with the sorted block numbers.  Inodes that
+ * are about to be looked up together, such as the entries of a directory
+ * block, mostly share table blocks; each one is read once, in disk order.
+ */
+void ext2_inode_readahead(struct super_block *sb, unsigned long *inos, int nr)
+{
+	unsigned long prev = 0;
+	struct blk_plug plug;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (inos[i] < EXT2_FIRST_INO(sb) && inos[i] != EXT2_ROOT_INO)
+			inos[i] = 0;
+		else if (inos[i] > le32_to_cpu(EXT2_SB(sb)->s_es->s_inodes_count))
+			inos[i] = 0;
+		else
+			inos[i] = ext2_inode_table_block(sb, inos[i]);
+	}
+	sort(inos, nr, sizeof(*inos), ext2_cmp_block, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		if (inos[i] && inos[i] != prev)
+			sb_breadahead(sb, inos[i]);
+		prev = inos[i];
+	}
+	blk_finish_plug(&plug);
 }
 
 /*
@@ -204,7 +561,7 @@ static int find_group_dir(struct super_block *sb, struct inode *parent)
 	int group, best_group = -1;
 
 	for (group = 0; group < ngroups; group++) {
-		desc = ext2_get_group_desc (sb, group, NULL);
+		desc = ext2_peek_group_desc(sb, group, NULL);
 		if (!desc || !desc->bg_free_inodes_count)
 			continue;
 		if (le16_to_cpu(desc->bg_free_inodes_count) < avefreei)
@@ -226,8 +583,9 @@ static int find_group_dir(struct super_block *sb, struct inode *parent)
  * We always try to spread first-level directories.
  *
  * If there are blockgroups with both free inodes and free blocks counts 
- * not worse than average we return one with smallest directory count. 
- * Otherwise we simply return a random group. 
+ * not worse than average we return one with smallest directory count,
+ * out of the first EXT2_GI_SCAN such groups in the buckets.  Otherwise
+ * we fall back as below.
  * 
  * For the rest rules look so: 
  * 
@@ -237,7 +595,8 @@ static int find_group_dir(struct super_block *sb, struct inode *parent)
  * it has too few free blocks left (min_blocks) or 
  * it's already running too large debt (max_debt). 
  * Parent's group is preferred, if it doesn't satisfy these 
- * conditions we search cyclically through the rest. If none 
+ * conditions we search cyclically through the next few groups, then
+ * through the buckets that can hold a suitable group. If none 
  * of the groups look good we just look for a group with more 
  * free inodes than average (starting at parent's group). 
  * 
@@ -248,6 +607,79 @@ static int find_group_dir(struct super_block *sb, struct inode *parent)
 #define INODE_COST 64
 #define BLOCK_COST 256
 
+/* Groups looked at in the buckets before giving up on them */
+#define EXT2_GI_SCAN 32
+
+static inline int ext2_quartile(int free, unsigned long total)
+{
+	if (free <= 0)
+		return 0;
+	return (unsigned long)free * EXT2_GI_QUARTILES / (total + 1);
+}
+
+static int ext2_group_bucket(struct super_block *sb,
+			     struct ext2_group_desc *desc)
+{
+	return ext2_quartile(le16_to_cpu(desc->bg_free_inodes_count),
+			     EXT2_INODES_PER_GROUP(sb)) * EXT2_GI_QUARTILES +
+	       ext2_quartile(le16_to_cpu(desc->bg_free_blocks_count),
+			     EXT2_BLOCKS_PER_GROUP(sb));
+}
+
+int ext2_init_group_info(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_desc *desc;
+	int i;
+
+	sbi->s_group_info = kvcalloc(sbi->s_groups_count,
+				     sizeof(*sbi->s_group_info), GFP_KERNEL);
+	if (!sbi->s_group_info)
+		return -ENOMEM;
+	spin_lock_init(&sbi->s_group_info_lock);
+	for (i = 0; i < EXT2_GI_BUCKETS; i++)
+		INIT_LIST_HEAD(&sbi->s_group_buckets[i]);
+	for (i = 0; i < sbi->s_groups_count; i++) {
+		struct ext2_group_info *gi = &sbi->s_group_info[i];
+
+		INIT_LIST_HEAD(&gi->gi_bitmap_lru);
+		desc = ext2_peek_group_desc(sb, i, NULL);
+		gi->gi_bucket = desc ? ext2_group_bucket(sb, desc) : 0;
+		list_add_tail(&gi->gi_list, &sbi->s_group_buckets[gi->gi_bucket]);
+	}
+	return 0;
+}
+
+/*
+ * The free counts of @group have changed.  Groups only change buckets
+ * when they cross a quarter of the group, so this rarely takes the lock.
+ */
+void ext2_group_info_update(struct super_block *sb, int group,
+			    struct ext2_group_desc *desc)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_info *gi = &sbi->s_group_info[group];
+	int bucket = ext2_group_bucket(sb, desc);
+
+	if (READ_ONCE(gi->gi_bucket) == bucket)
+		return;
+	spin_lock(&sbi->s_group_info_lock);
+	bucket = ext2_group_bucket(sb, desc);
+	if (gi->gi_bucket != bucket) {
+		gi->gi_bucket = bucket;
+		list_move_tail(&gi->gi_list, &sbi->s_group_buckets[bucket]);
+	}
+	spin_unlock(&sbi->s_group_info_lock);
+}
+
+/*
+ * Walk the buckets of groups with at least @qi quarters of their inodes
+ * and @qb quarters of their blocks free, emptiest first.
+ */
+#define for_each_group_bucket(bi, bb, qi, qb)				\
+	for (bi = EXT2_GI_QUARTILES - 1; bi >= (qi); bi--)		\
+		for (bb = EXT2_GI_QUARTILES - 1; bb >= (qb); bb--)
+
 static int find_group_orlov(struct super_block *sb, struct inode *parent)
 {
 	int parent_group = EXT2_I(parent)->i_block_group;
@@ -262,7 +694,8 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 	int blocks_per_dir;
 	int ndirs;
 	int max_debt, max_dirs, min_blocks, min_inodes;
-	int group = -1, i;
+	int group = -1, i, bi, bb, scanned = 0;
+	struct ext2_group_info *gi;
 	struct ext2_group_desc *desc;
 
 	freei = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
@@ -276,21 +709,41 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 		int best_ndir = inodes_per_group;
 		int best_group = -1;
 
-		parent_group = get_random_u32_below(ngroups);
-		for (i = 0; i < ngroups; i++) {
-			group = (parent_group + i) % ngroups;
-			desc = ext2_get_group_desc (sb, group, NULL);
-			if (!desc || !desc->bg_free_inodes_count)
-				continue;
-			if (le16_to_cpu(desc->bg_used_dirs_count) >= best_ndir)
-				continue;
-			if (le16_to_cpu(desc->bg_free_inodes_count) < avefreei)
-				continue;
-			if (le16_to_cpu(desc->bg_free_blocks_count) < avefreeb)
-				continue;
-			best_group = group;
-			best_ndir = le16_to_cpu(desc->bg_used_dirs_count);
+		/*
+		 * Only groups from buckets above average can qualify.  The one
+		 * picked goes to the back of its bucket, which spreads
+		 * top-level directories over equally good groups.
+		 */
+		spin_lock(&sbi->s_group_info_lock);
+		for_each_group_bucket(bi, bb,
+				      ext2_quartile(avefreei, inodes_per_group),
+				      ext2_quartile(avefreeb,
+						    EXT2_BLOCKS_PER_GROUP(sb))) {
+			list_for_each_entry(gi, &sbi->s_group_buckets[
+					bi * EXT2_GI_QUARTILES + bb], gi_list) {
+				if (++scanned > EXT2_GI_SCAN)
+					goto top_done;
+				group = gi - sbi->s_group_info;
+				desc = ext2_peek_group_desc(sb, group, NULL);
+				if (!desc || !desc->bg_free_inodes_count)
+					continue;
+				if (le16_to_cpu(desc->bg_used_dirs_count) >= best_ndir)
+					continue;
+				if (le16_to_cpu(desc->bg_free_inodes_count) < avefreei)
+					continue;
+				if (le16_to_cpu(desc->bg_free_blocks_count) < avefreeb)
+					continue;
+				best_group = group;
+				best_ndir = le16_to_cpu(desc->bg_used_dirs_count);
+			}
+		}
+top_done:
+		if (best_group >= 0) {
+			gi = &sbi->s_group_info[best_group];
+			list_move_tail(&gi->gi_list,
+				       &sbi->s_group_buckets[gi->gi_bucket]);
 		}
+		spin_unlock(&sbi->s_group_info_lock);
 		if (best_group >= 0) {
 			group = best_group;
 			goto found;
@@ -315,9 +768,13 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 	if (max_debt == 0)
 		max_debt = 1;
 
-	for (i = 0; i < ngroups; i++) {
+	/*
+	 * Parent's group and its neighbours first, for locality; then the
+	 * groups of the buckets that can meet min_inodes and min_blocks.
+	 */
+	for (i = 0; i < min(ngroups, EXT2_GI_SCAN); i++) {
 		group = (parent_group + i) % ngroups;
-		desc = ext2_get_group_desc (sb, group, NULL);
+		desc = ext2_peek_group_desc(sb, group, NULL);
 		if (!desc || !desc->bg_free_inodes_count)
 			continue;
 		if (sbi->s_debts[group] >= max_debt)
@@ -331,10 +788,38 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 		goto found;
 	}
 
+	spin_lock(&sbi->s_group_info_lock);
+	for_each_group_bucket(bi, bb,
+			      ext2_quartile(min_inodes, inodes_per_group),
+			      ext2_quartile(min_blocks,
+					    EXT2_BLOCKS_PER_GROUP(sb))) {
+		list_for_each_entry(gi, &sbi->s_group_buckets[
+				bi * EXT2_GI_QUARTILES + bb], gi_list) {
+			if (++scanned > EXT2_GI_SCAN)
+				goto bucket_done;
+			group = gi - sbi->s_group_info;
+			desc = ext2_peek_group_desc(sb, group, NULL);
+			if (!desc || !desc->bg_free_inodes_count)
+				continue;
+			if (sbi->s_debts[group] >= max_debt)
+				continue;
+			if (le16_to_cpu(desc->bg_used_dirs_count) >= max_dirs)
+				continue;
+			if (le16_to_cpu(desc->bg_free_inodes_count) < min_inodes)
+				continue;
+			if (le16_to_cpu(desc->bg_free_blocks_count) < min_blocks)
+				continue;
+			spin_unlock(&sbi->s_group_info_lock);
+			goto found;
+		}
+	}
+bucket_done:
+	spin_unlock(&sbi->s_group_info_lock);
+
 fallback:
 	for (i = 0; i < ngroups; i++) {
 		group = (parent_group + i) % ngroups;
-		desc = ext2_get_group_desc (sb, group, NULL);
+		desc = ext2_peek_group_desc(sb, group, NULL);
 		if (!desc || !desc->bg_free_inodes_count)
 			continue;
 		if (le16_to_cpu(desc->bg_free_inodes_count) >= avefreei)
@@ -356,6 +841,28 @@ found:
 	return group;
 }
 
+/*
+ * With -o numa_groups each NUMA node has its own slice of the groups as
+ * the default home of new files, so that CPUs on different nodes mostly
+ * allocate from different bitmaps and descriptors.  A parent directory in
+ * the local slice keeps its files; otherwise @seed picks a group in it.
+ */
+static int ext2_local_group(struct super_block *sb, int parent_group,
+			    unsigned long seed)
+{
+	int ngroups = EXT2_SB(sb)->s_groups_count;
+	int node = numa_node_id();
+	int first, nr;
+
+	if (nr_node_ids <= 1 || ngroups < nr_node_ids)
+		return parent_group;
+	first = (u64)ngroups * node / nr_node_ids;
+	nr = (u64)ngroups * (node + 1) / nr_node_ids - first;
+	if (parent_group >= first && parent_group < first + nr)
+		return parent_group;
+	return first + seed % nr;
+}
+
 static int find_group_other(struct super_block *sb, struct inode *parent)
 {
 	int parent_group = EXT2_I(parent)->i_block_group;
@@ -363,6 +870,10 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 	struct ext2_group_desc *desc;
 	int group, i;
 
+	if (test_opt(sb, NUMA_GROUPS))
+		parent_group = ext2_local_group(sb, parent_group,
+						parent->i_ino);
+
 	/*
 	 * Try to place the inode in its parent directory
 	 */
@@ -391,7 +902,7 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 		group += i;
 		if (group >= ngroups)
 			group -= ngroups;
-		desc = ext2_get_group_desc (sb, group, NULL);
+		desc = ext2_peek_group_desc(sb, group, NULL);
 		if (desc && le16_to_cpu(desc->bg_free_inodes_count) &&
 				le16_to_cpu(desc->bg_free_blocks_count))
 			goto found;
@@ -405,7 +916,7 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 	for (i = 0; i < ngroups; i++) {
 		if (++group >= ngroups)
 			group = 0;
-		desc = ext2_get_group_desc (sb, group, NULL);
+		desc = ext2_peek_group_desc(sb, group, NULL);
 		if (desc && le16_to_cpu(desc->bg_free_inodes_count))
 			goto found;
 	}
@@ -416,14 +927,190 @@ found:
 	return group;
 }
 
+/*
+ * uninit_bg keeps in bg_itable_unused how many inodes at the end of a group
+ * were never handed out.  Their part of the inode table need not have been
+ * written by mkfs; s_itable_work zeroes it in the background and sets
+ * EXT2_BG_INODE_ZEROED when done.
+ */
+#define EXT2_ITABLE_DELAY	(HZ / 10)
+#define EXT2_ITABLE_BATCH	16
+
+/* Set up an inode table block nobody has used in memory, not from disk. */
+static void ext2_new_itable_block(struct super_block *sb, ext2_fsblk_t block)
+{
+	struct buffer_head *bh = sb_getblk(sb, block);
+
+	if (!bh)
+		return;
+	lock_buffer(bh);
+	if (buffer_uptodate(bh)) {
+		unlock_buffer(bh);
+	} else {
+		memset(bh->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+	}
+	brelse(bh);
+}
+
+/*
+ * Inodes below @end in @group have been taken: the inode bitmap is real now,
+ * and bg_itable_unused moves past them.  Table blocks that lay wholly in the
+ * unused part are zeroed in memory, so writing the new inodes reads nothing.
+ */
+static void ext2_itable_used(struct super_block *sb, int group,
+			     unsigned int end)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned int ipg = EXT2_INODES_PER_GROUP(sb);
+	unsigned int ipb = sbi->s_inodes_per_block;
+	struct ext2_group_desc *desc;
+	struct buffer_head *bh;
+	unsigned int used, blk;
+	bool zeroed;
+
+	if (!EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_GDT_CSUM))
+		return;
+	desc = ext2_get_group_desc(sb, group, &bh);
+	if (!desc)
+		return;
+	/* the flag is only ever cleared, and the unused part only shrinks */
+	if (!(desc->bg_flags & cpu_to_le16(EXT2_BG_INODE_UNINIT)) &&
+	    ipg - le16_to_cpu(desc->bg_itable_unused) >= end)
+		return;
+
+	/* keep s_itable_work from zeroing the blocks being taken */
+	zeroed = desc->bg_flags & cpu_to_le16(EXT2_BG_INODE_ZEROED);
+	if (!zeroed)
+		down_read(&sbi->s_itable_sem);
+	spin_lock(sb_bgl_lock(sbi, group));
+	used = ipg - le16_to_cpu(desc->bg_itable_unused);
+	desc->bg_flags &= cpu_to_le16(~EXT2_BG_INODE_UNINIT);
+	if (end > used)
+		desc->bg_itable_unused = cpu_to_le16(ipg - end);
+	ext2_group_desc_csum_set(sb, group, desc);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	if (!zeroed)
+		up_read(&sbi->s_itable_sem);
+	mark_buffer_dirty(bh);
+
+	for (blk = DIV_ROUND_UP(used, ipb); blk * ipb < end; blk++)
+		ext2_new_itable_block(sb, le32_to_cpu(desc->bg_inode_table) +
+					  blk);
+}
+
+/*
+ * Zero the unused part of the inode table of @group.  Returns 1 if it did,
+ * 0 if there was nothing to do, or a negative error.
+ */
+static int ext2_zero_itable(struct super_block *sb, unsigned long group)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned int ipb = sbi->s_inodes_per_block;
+	struct ext2_group_desc *desc;
+	struct buffer_head *bh, *tbh;
+	ext2_fsblk_t itable;
+	unsigned long blk;
+	unsigned int used;
+	int err = 0;
+
+	/*
+	 * Groups whose descriptors are not read in (-o lazy_gdt) are left
+	 * alone rather than read for this: new inodes there still get
+	 * zeroed inode table blocks from ext2_itable_used().
+	 */
+	desc = ext2_peek_group_desc(sb, group, &bh);
+	if (!desc || (desc->bg_flags & cpu_to_le16(EXT2_BG_INODE_ZEROED)))
+		return 0;
+
+	down_write(&sbi->s_itable_sem);
+	spin_lock(sb_bgl_lock(sbi, group));
+	used = EXT2_INODES_PER_GROUP(sb) - le16_to_cpu(desc->bg_itable_unused);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	itable = le32_to_cpu(desc->bg_inode_table);
+	blk = DIV_ROUND_UP(used, ipb);
+	if (blk < sbi->s_itb_per_group) {
+		err = sb_issue_zeroout(sb, itable + blk,
+				       sbi->s_itb_per_group - blk, GFP_NOFS);
+		if (err)
+			goto out;
+		/* readahead may have cached what was there before */
+		for (; blk < sbi->s_itb_per_group; blk++) {
+			tbh = sb_find_get_block(sb, itable + blk);
+			if (!tbh)
+				continue;
+			lock_buffer(tbh);
+			memset(tbh->b_data, 0, sb->s_blocksize);
+			set_buffer_uptodate(tbh);
+			unlock_buffer(tbh);
+			brelse(tbh);
+		}
+	}
+	spin_lock(sb_bgl_lock(sbi, group));
+	desc->bg_flags |= cpu_to_le16(EXT2_BG_INODE_ZEROED);
+	ext2_group_desc_csum_set(sb, group, desc);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	mark_buffer_dirty(bh);
+	err = 1;
+out:
+	up_write(&sbi->s_itable_sem);
+	return err;
+}
+
+void ext2_itable_work(struct work_struct *work)
+{
+	struct ext2_sb_info *sbi = container_of(to_delayed_work(work),
+					struct ext2_sb_info, s_itable_work);
+	struct super_block *sb = sbi->s_sb;
+	int done = 0, err;
+
+	/* a frozen fs is picked up again by ext2_unfreeze() */
+	if (!sb_start_intwrite_trylock(sb))
+		return;
+	while (done < EXT2_ITABLE_BATCH &&
+	       sbi->s_itable_next < sbi->s_groups_count) {
+		if (sb_rdonly(sb) || !test_opt(sb, INIT_ITABLE))
+			goto out;
+		err = ext2_zero_itable(sb, sbi->s_itable_next);
+		if (err < 0) {
+			ext2_msg(sb, KERN_WARNING,
+				 "stopped zeroing inode tables at group %lu: %d",
+				 sbi->s_itable_next, err);
+			sbi->s_itable_next = sbi->s_groups_count;
+			goto out;
+		}
+		done += err;
+		sbi->s_itable_next++;
+	}
+	ext2_start_itable_init(sb);
+out:
+	sb_end_intwrite(sb);
+}
+
+void ext2_start_itable_init(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	if (EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    test_opt(sb, INIT_ITABLE) && !sb_rdonly(sb) &&
+	    sbi->s_itable_next < sbi->s_groups_count)
+		queue_delayed_work(system_unbound_wq, &sbi->s_itable_work,
+				   EXT2_ITABLE_DELAY);
+}
+
 struct inode *ext2_new_inode(struct inode *dir, umode_t mode,
 			     const struct qstr *qstr)
 {
 	struct super_block *sb;
 	struct buffer_head *bitmap_bh = NULL;
-	struct buffer_head *bh2;
 	int group, i;
 	ino_t ino = 0;
+	unsigned long goal, start;
+	unsigned int reserved = 0;
+	bool pool = !S_ISDIR(mode) && test_opt(dir->i_sb, INODE_POOL);
+	bool folded = false;
 	struct inode * inode;
 	struct ext2_group_desc *gdp;
 	struct ext2_super_block *es;
@@ -439,6 +1126,14 @@ struct inode *ext2_new_inode(struct inode *dir, umode_t mode,
 	ei = EXT2_I(inode);
 	sbi = EXT2_SB(sb);
 	es = sbi->s_es;
+	if (pool) {
+		ino = ext2_ino_pool_take(dir, &group);
+		if (ino) {
+			ext2_adjust_inode_counts(sb, group, 0, 0, -1);
+			goto got_ino;
+		}
+	}
+find_group:
 	if (S_ISDIR(mode)) {
 		if (test_opt(sb, OLDALLOC))
 			group = find_group_dir(sb, dir);
@@ -447,13 +1142,25 @@ struct inode *ext2_new_inode(struct inode *dir, umode_t mode,
 	} else 
 		group = find_group_other(sb, dir);
 
+	if (group == -1 && !folded) {
+		/*
+		 * The descriptors may not show inodes freed lately, or
+		 * may not all be read in yet.
+		 */
+		if (ext2_gdt_partial(sbi))
+			ext2_load_group_descs(sb);
+		ext2_fold_inode_deltas(sb);
+		folded = true;
+		goto find_group;
+	}
 	if (group == -1) {
 		err = -ENOSPC;
 		goto fail;
 	}
 
+	goal = READ_ONCE(EXT2_I(dir)->i_last_alloc_ino);
 	for (i = 0; i < sbi->s_groups_count; i++) {
-		gdp = ext2_get_group_desc(sb, group, &bh2);
+		gdp = ext2_peek_group_desc(sb, group, NULL);
 		if (!gdp) {
 			if (++group == sbi->s_groups_count)
 				group = 0;
@@ -465,11 +1172,22 @@ struct inode *ext2_new_inode(struct inode *dir, umode_t mode,
 			err = -EIO;
 			goto fail;
 		}
-		ino = 0;
+		/*
+		 * Look right after the sibling allocated last, wrapping
+		 * around to the start of the group.
+		 */
+		start = 0;
+		if (goal && (goal - 1) / EXT2_INODES_PER_GROUP(sb) == group)
+			start = (goal - 1) % EXT2_INODES_PER_GROUP(sb) + 1;
+		ino = start;
 
 repeat_in_this_group:
 		ino = ext2_find_next_zero_bit((unsigned long *)bitmap_bh->b_data,
 					      EXT2_INODES_PER_GROUP(sb), ino);
+		if (ino >= EXT2_INODES_PER_GROUP(sb) && start) {
+			ino = start = 0;
+			goto repeat_in_this_group;
+		}
 		if (ino >= EXT2_INODES_PER_GROUP(sb)) {
 			/*
 			 * Rare race: find_group_xx() decided that there were
@@ -486,7 +1204,7 @@ repeat_in_this_group:
 		if (ext2_set_bit_atomic(sb_bgl_lock(sbi, group),
 						ino, bitmap_bh->b_data)) {
 			/* we lost this inode */
-			if (++ino >= EXT2_INODES_PER_GROUP(sb)) {
+			if (++ino >= EXT2_INODES_PER_GROUP(sb) && !start) {
 				/* this group is exhausted, try next group */
 				if (++group == sbi->s_groups_count)
 					group = 0;
@@ -495,6 +1213,13 @@ repeat_in_this_group:
 			/* try to find free inode in the same group */
 			goto repeat_in_this_group;
 		}
+		/* and the free ones right after it for the pool */
+		while (pool && reserved < EXT2_INO_POOL - 1 &&
+		       ino + 1 + reserved < EXT2_INODES_PER_GROUP(sb) &&
+		       !ext2_set_bit_atomic(sb_bgl_lock(sbi, group),
+					    ino + 1 + reserved,
+					    bitmap_bh->b_data))
+			reserved++;
 		goto got;
 	}
 
@@ -520,23 +1245,25 @@ got:
 		goto fail;
 	}
 
-	percpu_counter_dec(&sbi->s_freeinodes_counter);
+	ext2_itable_used(sb, group,
+			 (ino - 1) % EXT2_INODES_PER_GROUP(sb) + 1 + reserved);
+
+	percpu_counter_sub(&sbi->s_freeinodes_counter, 1 + reserved);
 	if (S_ISDIR(mode))
 		percpu_counter_inc(&sbi->s_dirs_counter);
 
-	spin_lock(sb_bgl_lock(sbi, group));
-	le16_add_cpu(&gdp->bg_free_inodes_count, -1);
-	if (S_ISDIR(mode)) {
-		if (sbi->s_debts[group] < 255)
-			sbi->s_debts[group]++;
-		le16_add_cpu(&gdp->bg_used_dirs_count, 1);
-	} else {
-		if (sbi->s_debts[group])
-			sbi->s_debts[group]--;
-	}
-	spin_unlock(sb_bgl_lock(sbi, group));
+	if (S_ISDIR(mode))
+		ext2_adjust_inode_counts(sb, group, -1, 1, 1);
+	else
+		ext2_adjust_inode_counts(sb, group, -1 - reserved, 0, -1);
+
+	if (reserved) {
+		unsigned int bit = (ino - 1) % EXT2_INODES_PER_GROUP(sb);
 
-	mark_buffer_dirty(bh2);
+		ext2_ino_pool_fill(dir, group, bit + 1, bit + 1 + reserved);
+	}
+got_ino:
+	WRITE_ONCE(EXT2_I(dir)->i_last_alloc_ino, ino);
 	if (test_opt(sb, GRPID)) {
 		inode->i_mode = mode;
 		inode->i_uid = current_fsuid();
@@ -609,6 +1336,21 @@ fail:
 	return ERR_PTR(err);
 }
 
+/* Inodes freed or allocated on some CPU but not yet in the descriptors */
+static long ext2_pending_free_inodes(struct super_block *sb)
+{
+	struct ext2_inode_deltas *d;
+	long count = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		d = per_cpu_ptr(EXT2_SB(sb)->s_inode_deltas, cpu);
+		for (i = 0; i < EXT2_IDELTA_SLOTS; i++)
+			count += READ_ONCE(d->slot[i].free);
+	}
+	return count;
+}
+
 unsigned long ext2_count_free_inodes (struct super_block * sb)
 {
 	struct ext2_group_desc *desc;
@@ -620,6 +1362,11 @@ unsigned long ext2_count_free_inodes (struct super_block * sb)
 	unsigned long bitmap_count = 0;
 	struct buffer_head *bitmap_bh = NULL;
 
+	/* until every descriptor is in, the counter is all there is */
+	if (ext2_gdt_partial(EXT2_SB(sb)))
+		return percpu_counter_sum_positive(
+				&EXT2_SB(sb)->s_freeinodes_counter);
+
 	es = EXT2_SB(sb)->s_es;
 	for (i = 0; i < EXT2_SB(sb)->s_groups_count; i++) {
 		unsigned x;
@@ -643,29 +1390,18 @@ unsigned long ext2_count_free_inodes (struct super_block * sb)
 		(unsigned long)
 		percpu_counter_read(&EXT2_SB(sb)->s_freeinodes_counter),
 		desc_count, bitmap_count);
-	return desc_count;
+	return desc_count + ext2_pending_free_inodes(sb);
 #else
+	/* until every descriptor is in, the counter is all there is */
+	if (ext2_gdt_partial(EXT2_SB(sb)))
+		return percpu_counter_sum_positive(
+				&EXT2_SB(sb)->s_freeinodes_counter);
 	for (i = 0; i < EXT2_SB(sb)->s_groups_count; i++) {
 		desc = ext2_get_group_desc (sb, i, NULL);
 		if (!desc)
 			continue;
 		desc_count += le16_to_cpu(desc->bg_free_inodes_count);
 	}
-	return desc_count;
+	return desc_count + ext2_pending_free_inodes(sb);
 #endif
 }
-
-/* Called at mount-time, super-block is locked */
-unsigned long ext2_count_dirs (struct super_block * sb)
-{
-	unsigned long count = 0;
-	int i;
-
-	for (i = 0; i < EXT2_SB(sb)->s_groups_count; i++) {
-		struct ext2_group_desc *gdp = ext2_get_group_desc (sb, i, NULL);
-		if (!gdp)
-			continue;
-		count += le16_to_cpu(gdp->bg_used_dirs_count);
-	}
-	return count;
-}
\ No newline at end of file
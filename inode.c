@@ -59,13 +59,138 @@ static void ext2_truncate_blocks(struct inode *inode, loff_t offset);
 void ext2_write_failed(struct address_space *mapping, loff_t to)
 {
 	struct inode *inode = mapping->host;
+	loff_t size = inode->i_size;
 
-	if (to > inode->i_size) {
-		truncate_pagecache(inode, inode->i_size);
-		ext2_truncate_blocks(inode, inode->i_size);
+	/*
+	 * Blocks past i_size may belong to asynchronous extending direct
+	 * writes that have not completed yet.  Leave those alone.
+	 */
+	if (ext2_dio_extends_pending(inode))
+		size = max(size, ext2_dio_extend_end(inode));
+
+	if (to > size) {
+		truncate_pagecache(inode, size);
+		ext2_truncate_blocks(inode, size);
 	}
 }
 
+/*
+ * Deferred reclamation of unlinked inodes
+ * ---------------------------------------
+ * With -o defer_free the last iput() of an unlinked inode that uses indirect
+ * blocks does not free them in the caller's context.  ext2_drop_inode() keeps
+ * the inode cached and queues it on sbi->s_orphan_list, and s_orphan_work
+ * truncates it before letting it go through the normal eviction path, which
+ * is then cheap.  Space held by queued inodes is reported as free by statfs.
+ * The list is drained by sync (and so before a freeze and at unmount), and an
+ * allocation about to fail with ENOSPC waits for it once.
+ */
+
+/* Called with s_orphan_lock held */
+static void ext2_orphan_unaccount(struct inode *inode)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+
+	list_del_init(&EXT2_I(inode)->i_orphan);
+	sbi->s_orphan_blocks -= inode->i_blocks >>
+				(inode->i_blkbits - 9);
+	sbi->s_orphan_count--;
+}
+
+static void ext2_orphan_del(struct inode *inode)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+
+	if (!(EXT2_I(inode)->i_state & EXT2_STATE_ORPHAN))
+		return;
+	spin_lock(&sbi->s_orphan_lock);
+	if (!list_empty(&EXT2_I(inode)->i_orphan))
+		ext2_orphan_unaccount(inode);
+	spin_unlock(&sbi->s_orphan_lock);
+}
+
+/*
+ * Called under inode->i_lock by iput_final().  Returning 0 keeps the inode
+ * in the cache, where s_orphan_work picks it up.
+ */
+int ext2_drop_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	int drop = generic_drop_inode(inode);
+
+	if (!drop || inode->i_nlink || !test_opt(sb, DEFER_FREE) ||
+	    !(sb->s_flags & SB_ACTIVE) || is_bad_inode(inode) ||
+	    (ei->i_state & EXT2_STATE_ORPHAN) || !ei->i_data[EXT2_IND_BLOCK])
+		return drop;
+
+	ei->i_state |= EXT2_STATE_ORPHAN;
+	spin_lock(&sbi->s_orphan_lock);
+	list_add_tail(&ei->i_orphan, &sbi->s_orphan_list);
+	sbi->s_orphan_blocks += inode->i_blocks >> (inode->i_blkbits - 9);
+	sbi->s_orphan_count++;
+	spin_unlock(&sbi->s_orphan_lock);
+	queue_work(system_unbound_wq, &sbi->s_orphan_work);
+	return 0;
+}
+
+void ext2_orphan_work(struct work_struct *work)
+{
+	struct ext2_sb_info *sbi = container_of(work, struct ext2_sb_info,
+						s_orphan_work);
+	struct super_block *sb = sbi->s_sb;
+	struct ext2_inode_info *ei;
+	struct inode *inode;
+
+	/* a frozen fs is picked up again by ext2_unfreeze() */
+	while (sb_start_intwrite_trylock(sb)) {
+		spin_lock(&sbi->s_orphan_lock);
+		ei = list_first_entry_or_null(&sbi->s_orphan_list,
+					      struct ext2_inode_info, i_orphan);
+		if (!ei) {
+			spin_unlock(&sbi->s_orphan_lock);
+			sb_end_intwrite(sb);
+			break;
+		}
+		inode = &ei->vfs_inode;
+		ext2_orphan_unaccount(inode);
+		/*
+		 * Once off the list the inode can be evicted under us; RCU
+		 * keeps it from being freed until i_state has been checked.
+		 */
+		rcu_read_lock();
+		spin_unlock(&sbi->s_orphan_lock);
+		spin_lock(&inode->i_lock);
+		if (inode->i_state & (I_FREEING | I_WILL_FREE)) {
+			spin_unlock(&inode->i_lock);
+			rcu_read_unlock();
+			sb_end_intwrite(sb);
+			continue;
+		}
+		__iget(inode);
+		spin_unlock(&inode->i_lock);
+		rcu_read_unlock();
+
+		inode_lock(inode);
+		truncate_pagecache(inode, 0);
+		i_size_write(inode, 0);
+		ext2_truncate_blocks(inode, 0);
+		inode_unlock(inode);
+		sb_end_intwrite(sb);
+
+		/* i_nlink is zero and EXT2_STATE_ORPHAN set: evicts for good */
+		iput(inode);
+		cond_resched();
+	}
+}
+
+void ext2_flush_orphans(struct super_block *sb)
+{
+	if (ext2_orphans_pending(sb))
+		flush_work(&EXT2_SB(sb)->s_orphan_work);
+}
+
 /*
  * Called at the last iput() if i_nlink is zero.
  */
@@ -74,6 +199,12 @@ void ext2_evict_inode(struct inode * inode)
 	struct ext2_block_alloc_info *rsv;
 	int want_delete = 0;
 
+	ext2_orphan_del(inode);
+	ext2_compact_del(inode);
+	ext2_ino_pool_drop(inode);
+	ext2_dir_cache_drop(inode);
+	ext2_dir_gaps_drop(inode);
+
 	if (!inode->i_nlink && !is_bad_inode(inode)) {
 		want_delete = 1;
 		dquot_initialize(inode);
@@ -850,7 +981,8 @@ static int ext2_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
 		 * based filesystem to avoid stale data exposure problem.
 		 */
 		if (!create && (flags & IOMAP_WRITE) && (flags & IOMAP_DIRECT))
-			return -ENOTBLK;
+			return (flags & IOMAP_OVERWRITE_ONLY) ? -EAGAIN :
+								-ENOTBLK;
 		iomap->type = IOMAP_HOLE;
 		iomap->addr = IOMAP_NULL_ADDR;
 		iomap->length = 1 << blkbits;
@@ -868,6 +1000,65 @@ static int ext2_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
 	return 0;
 }
 
+/*
+ * Return true if every block backing [pos, pos + len) is already allocated,
+ * i.e. a direct write there is a pure overwrite that needs neither block
+ * allocation nor an i_size update.
+ */
+bool ext2_dio_overwrite(struct inode *inode, loff_t pos, size_t len)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t iblock = pos >> blkbits;
+	sector_t last = (pos + len + (1 << blkbits) - 1) >> blkbits;
+	bool new, boundary;
+	u32 bno;
+	int ret;
+
+	if (pos + len > i_size_read(inode))
+		return false;
+
+	while (iblock < last) {
+		ret = ext2_get_blocks(inode, iblock, last - iblock,
+				      &bno, &new, &boundary, 0);
+		if (ret <= 0)
+			return false;
+		iblock += ret;
+	}
+	return true;
+}
+
+/*
+ * Write zeroes over every block that is mapped in [start, end).  Used when an
+ * asynchronous extending direct write fails after its blocks were allocated:
+ * ext2 has no unwritten extents, so the only way to keep stale disk contents
+ * from showing up once i_size moves past them is to clear them on disk.
+ */
+int ext2_zero_mapped_range(struct inode *inode, loff_t start, loff_t end)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t iblock = start >> blkbits;
+	sector_t last = (end + (1 << blkbits) - 1) >> blkbits;
+	bool new, boundary;
+	u32 bno;
+	int ret, err;
+
+	while (iblock < last) {
+		ret = ext2_get_blocks(inode, iblock, last - iblock,
+				      &bno, &new, &boundary, 0);
+		if (ret < 0)
+			return ret;
+		if (ret == 0) {
+			iblock++;
+			continue;
+		}
+		err = sb_issue_zeroout(inode->i_sb, bno, ret, GFP_NOFS);
+		if (err)
+			return err;
+		iblock += ret;
+	}
+	return 0;
+}
+
 static int
 ext2_iomap_end(struct inode *inode, loff_t offset, loff_t length,
 		ssize_t written, unsigned flags, struct iomap *iomap)
@@ -904,6 +1095,422 @@ int ext2_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 	return ret;
 }
 
+/*
+ * EXT2_IOC_FRAGSTAT for a file: walk the block map the way ext2_fiemap()
+ * does, through ext2_get_blocks(), but join runs that only break at an
+ * indirect block boundary, since they are contiguous on disk.
+ */
+int ext2_file_fragstat(struct inode *inode, struct ext2_fragstat *fr)
+{
+	bool new = false, boundary = false;
+	ext2_fsblk_t prev_end = 0, total;
+	u64 cur = 0;
+	sector_t lblk, end;
+	u32 bno;
+	int ret = 0;
+
+	inode_lock_shared(inode);
+	end = DIV_ROUND_UP(i_size_read(inode), i_blocksize(inode));
+	for (lblk = 0; lblk < end; ) {
+		ret = ext2_get_blocks(inode, lblk,
+				      min_t(sector_t, end - lblk, UINT_MAX),
+				      &bno, &new, &boundary, 0);
+		if (ret < 0)
+			break;
+		if (!ret) {
+			/* a hole */
+			prev_end = 0;
+			lblk++;
+			ret = 0;
+		} else {
+			if (bno != prev_end) {
+				fr->fr_extents++;
+				cur = 0;
+			}
+			cur += ret;
+			fr->fr_max_extent = max(fr->fr_max_extent, cur);
+			fr->fr_blocks += ret;
+			prev_end = bno + ret;
+			lblk += ret;
+			ret = 0;
+		}
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	/* what i_blocks holds beyond the data, less the xattr block */
+	total = inode->i_blocks >> (inode->i_blkbits - 9);
+	if (EXT2_I(inode)->i_file_acl)
+		total--;
+	if (total > fr->fr_blocks)
+		fr->fr_meta_blocks = total - fr->fr_blocks;
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+/*
+ * Online defragmentation (EXT2_IOC_DEFRAG).  A run of data blocks whose
+ * pointers share one pointer array (i_data or an indirect block) and that
+ * is in more than one piece is moved to blocks from one ext2_new_blocks()
+ * call:
+ *
+ *  - the page cache folios over the run are read in and locked,
+ *  - their contents are written to the new blocks and waited on,
+ *  - the pointers are switched under truncate_mutex, after checking that
+ *    they still hold the old blocks, and the array is written out,
+ *  - buffers of the folios mapping the old blocks are pointed at the new
+ *    ones, and only then are the old blocks freed.
+ *
+ * A crash at any point leaves the file with either the old blocks or the
+ * new ones, both holding its data.  The caller holds i_rwsem and the
+ * invalidate lock, so no write, truncate or direct I/O runs meanwhile.
+ * Indirect blocks are not moved.
+ */
+#define EXT2_DEFRAG_CHUNK	1024
+
+struct ext2_defrag_ctx {
+	ext2_fsblk_t		*old;
+	struct buffer_head	**bhs;
+	struct folio		**folios;
+	int			nr_folios;
+	u64			moved;
+};
+
+static void ext2_defrag_put_folios(struct ext2_defrag_ctx *dc)
+{
+	while (dc->nr_folios) {
+		struct folio *folio = dc->folios[--dc->nr_folios];
+
+		folio_unlock(folio);
+		folio_put(folio);
+	}
+}
+
+static int ext2_defrag_get_folios(struct inode *inode, sector_t lblk,
+				  unsigned long n, struct ext2_defrag_ctx *dc)
+{
+	struct address_space *mapping = inode->i_mapping;
+	pgoff_t index = ((loff_t)lblk << inode->i_blkbits) >> PAGE_SHIFT;
+	pgoff_t last = (((loff_t)(lblk + n) << inode->i_blkbits) - 1) >>
+		       PAGE_SHIFT;
+	struct folio *folio;
+
+	while (index <= last) {
+		folio = read_mapping_folio(mapping, index, NULL);
+		if (IS_ERR(folio))
+			return PTR_ERR(folio);
+		folio_lock(folio);
+		if (folio->mapping != mapping || !folio_test_uptodate(folio)) {
+			folio_unlock(folio);
+			folio_put(folio);
+			return -EIO;
+		}
+		folio_wait_writeback(folio);
+		dc->folios[dc->nr_folios++] = folio;
+		index = folio_next_index(folio);
+	}
+	return 0;
+}
+
+static struct folio *ext2_defrag_folio(struct ext2_defrag_ctx *dc, loff_t pos)
+{
+	int i;
+
+	for (i = 0; i < dc->nr_folios; i++)
+		if (pos >= folio_pos(dc->folios[i]) &&
+		    pos < folio_pos(dc->folios[i]) + folio_size(dc->folios[i]))
+			return dc->folios[i];
+	return NULL;
+}
+
+/* Write what the locked folios hold for the @n blocks at @lblk to @new. */
+static int ext2_defrag_copy(struct inode *inode, sector_t lblk,
+			    unsigned long n, ext2_fsblk_t new,
+			    struct ext2_defrag_ctx *dc)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long i, nr = 0;
+	struct folio *folio;
+	loff_t pos;
+	void *kaddr;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		struct buffer_head *bh = sb_getblk(sb, new + i);
+
+		if (!bh) {
+			err = -ENOMEM;
+			break;
+		}
+		pos = (loff_t)(lblk + i) << inode->i_blkbits;
+		folio = ext2_defrag_folio(dc, pos);
+		lock_buffer(bh);
+		kaddr = kmap_local_folio(folio, offset_in_folio(folio, pos));
+		memcpy(bh->b_data, kaddr, sb->s_blocksize);
+		kunmap_local(kaddr);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		write_dirty_buffer(bh, 0);
+		dc->bhs[nr++] = bh;
+	}
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(dc->bhs[i]);
+		if (!buffer_uptodate(dc->bhs[i]))
+			err = -EIO;
+		brelse(dc->bhs[i]);
+	}
+	return err;
+}
+
+/*
+ * Point the @n blocks at @lblk, reached through @offsets, at @new instead of
+ * dc->old, and write the pointer array out.  Returns 1 if the pointers were
+ * switched but could not be written.
+ */
+static int ext2_defrag_switch(struct inode *inode, sector_t lblk,
+			      unsigned long n, ext2_fsblk_t new,
+			      int depth, int *offsets,
+			      struct ext2_defrag_ctx *dc)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	Indirect chain[4], *partial;
+	struct buffer_head *bh;
+	unsigned long i;
+	__le32 *p;
+	int err;
+
+	mutex_lock(&ei->truncate_mutex);
+	partial = ext2_get_branch(inode, depth, offsets, chain, &err);
+	if (partial) {
+		if (!err)
+			err = -EAGAIN;
+		goto out;
+	}
+	partial = chain + depth - 1;
+	p = partial->p;
+	for (i = 0; i < n; i++) {
+		if (le32_to_cpu(p[i]) != dc->old[i]) {
+			err = -EAGAIN;
+			goto out;
+		}
+	}
+	write_lock(&ei->i_meta_lock);
+	for (i = 0; i < n; i++)
+		p[i] = cpu_to_le32(new + i);
+	write_unlock(&ei->i_meta_lock);
+
+	bh = partial->bh;
+	if (bh) {
+		mark_buffer_dirty_inode(bh, inode);
+		err = sync_dirty_buffer(bh);
+	} else {
+		mark_inode_dirty(inode);
+		err = sync_inode_metadata(inode, 1);
+	}
+	if (err)
+		err = 1;
+out:
+	mutex_unlock(&ei->truncate_mutex);
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	return err;
+}
+
+/* Buffers of the locked folios that map the old blocks now map @new. */
+static void ext2_defrag_remap(struct inode *inode, sector_t lblk,
+			      unsigned long n, ext2_fsblk_t new,
+			      struct ext2_defrag_ctx *dc)
+{
+	struct buffer_head *head, *bh;
+	sector_t block;
+	int i;
+
+	for (i = 0; i < dc->nr_folios; i++) {
+		head = folio_buffers(dc->folios[i]);
+		if (!head)
+			continue;
+		block = folio_pos(dc->folios[i]) >> inode->i_blkbits;
+		bh = head;
+		do {
+			if (block >= lblk && block < lblk + n &&
+			    buffer_mapped(bh))
+				bh->b_blocknr = new + (block - lblk);
+			block++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+}
+
+/*
+ * Defragment from @lblk, at most @len blocks.  Returns how many blocks were
+ * looked at, moved or not, or a negative error.
+ */
+static long ext2_defrag_run(struct inode *inode, sector_t lblk,
+			    unsigned long len, struct ext2_defrag_ctx *dc)
+{
+	struct super_block *sb = inode->i_sb;
+	bool new_blk = false, boundary = false;
+	unsigned long n = 0, first, count, i, start;
+	int offsets[4], depth, to_boundary, pieces = 0;
+	ext2_fsblk_t goal, new;
+	u32 bno;
+	int ret;
+
+	depth = ext2_block_to_path(inode, lblk, offsets, &to_boundary);
+	if (!depth)
+		return -EIO;
+	len = min(len, (unsigned long)to_boundary + 1);
+
+	while (n < len) {
+		ret = ext2_get_blocks(inode, lblk + n, len - n, &bno, &new_blk,
+				      &boundary, 0);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;
+		for (i = 0; i < ret; i++)
+			dc->old[n + i] = bno + i;
+		n += ret;
+		pieces++;
+	}
+	/* a hole, or already in one piece */
+	if (!n)
+		return 1;
+	if (pieces == 1)
+		return n;
+
+	/* right after the block before the run, or where the run starts */
+	goal = dc->old[0];
+	if (lblk && ext2_get_blocks(inode, lblk - 1, 1, &bno, &new_blk,
+				    &boundary, 0) > 0)
+		goal = bno + 1;
+	for (first = 1; first < n; first++)
+		if (dc->old[first] != dc->old[0] + first)
+			break;
+
+	count = n;
+	new = ext2_new_blocks(inode, goal, &count, &ret, 0);
+	if (ret)
+		return ret;
+	/* no better than the first piece: leave the run alone */
+	if (count <= first) {
+		ext2_free_blocks(inode, new, count);
+		return n;
+	}
+	n = count;
+	clean_bdev_aliases(sb->s_bdev, new, n);
+
+	ret = ext2_defrag_get_folios(inode, lblk, n, dc);
+	if (!ret)
+		ret = ext2_defrag_copy(inode, lblk, n, new, dc);
+	if (!ret)
+		ret = ext2_defrag_switch(inode, lblk, n, new, depth, offsets,
+					 dc);
+	if (ret < 0) {
+		ext2_defrag_put_folios(dc);
+		ext2_free_blocks(inode, new, count);
+		return ret;
+	}
+	ext2_defrag_remap(inode, lblk, n, new, dc);
+	ext2_defrag_put_folios(dc);
+	/* the disk may still point at the old blocks: keep them */
+	if (ret)
+		return -EIO;
+
+	for (start = 0, i = 1; i <= n; i++) {
+		if (i < n && dc->old[i] == dc->old[i - 1] + 1)
+			continue;
+		ext2_free_blocks(inode, dc->old[start], i - start);
+		start = i;
+	}
+	dc->moved += n;
+	return n;
+}
+
+/* Number of extents FIEMAP reports for the blocks of @df. */
+static u32 ext2_defrag_extents(struct inode *inode, struct ext2_defrag *df,
+			       u64 end)
+{
+	struct fiemap_extent_info fieinfo = { };
+	unsigned int bits = inode->i_blkbits;
+
+	/* with no room for extents fiemap only counts them */
+	if (ext2_fiemap(inode, &fieinfo, df->df_start << bits,
+			(end - df->df_start) << bits))
+		return 0;
+	return fieinfo.fi_extents_mapped;
+}
+
+int ext2_defrag(struct inode *inode, struct ext2_defrag *df)
+{
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int bits = inode->i_blkbits;
+	struct ext2_defrag_ctx dc = { };
+	sector_t lblk;
+	u64 end;
+	long ret = 0;
+
+	if (IS_DAX(inode))
+		return -EOPNOTSUPP;
+	end = DIV_ROUND_UP(i_size_read(inode), 1ULL << bits);
+	df->df_moved = 0;
+	df->df_extents_before = df->df_extents_after = 0;
+	if (df->df_start >= end)
+		return 0;
+	if (df->df_len && df->df_len < end - df->df_start)
+		end = df->df_start + df->df_len;
+	df->df_extents_before = ext2_defrag_extents(inode, df, end);
+
+	dc.old = kvmalloc_array(EXT2_DEFRAG_CHUNK, sizeof(*dc.old), GFP_KERNEL);
+	dc.bhs = kvmalloc_array(EXT2_DEFRAG_CHUNK, sizeof(*dc.bhs), GFP_KERNEL);
+	dc.folios = kvmalloc_array(EXT2_DEFRAG_CHUNK, sizeof(*dc.folios),
+				   GFP_KERNEL);
+	if (!dc.old || !dc.bhs || !dc.folios) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	inode_lock(inode);
+	filemap_invalidate_lock(mapping);
+	inode_dio_wait(inode);
+	/* the file may have been truncated meanwhile */
+	end = min_t(u64, end, DIV_ROUND_UP(i_size_read(inode), 1ULL << bits));
+	ret = filemap_write_and_wait_range(mapping, df->df_start << bits,
+					   (end << bits) - 1);
+	lblk = df->df_start;
+	while (!ret && lblk < end) {
+		ret = ext2_defrag_run(inode, lblk,
+				      min_t(u64, end - lblk, EXT2_DEFRAG_CHUNK),
+				      &dc);
+		/* out of space to move to: keep what has been done */
+		if (ret == -ENOSPC || ret == -EDQUOT) {
+			ret = 0;
+			break;
+		}
+		if (ret < 0)
+			break;
+		lblk += ret;
+		ret = fatal_signal_pending(current) ? -EINTR : 0;
+		cond_resched();
+	}
+	filemap_invalidate_unlock(mapping);
+	inode_unlock(inode);
+
+	df->df_moved = dc.moved;
+	if (end > df->df_start)
+		df->df_extents_after = ext2_defrag_extents(inode, df, end);
+out_free:
+	kvfree(dc.folios);
+	kvfree(dc.bhs);
+	kvfree(dc.old);
+	return ret < 0 ? ret : 0;
+}
+
 static int ext2_read_folio(struct file *file, struct folio *folio)
 {
 	return mpage_read_folio(folio, ext2_get_block);
@@ -1076,7 +1683,7 @@ no_top:
 
 /**
  *	ext2_free_data - free a list of data blocks
- *	@inode:	inode we are dealing with
+ *	@fb:	batch the blocks are queued on
  *	@p:	array of block numbers
  *	@q:	points immediately past the end of array
  *
@@ -1084,7 +1691,8 @@ no_top:
  *	stored as little-endian 32-bit) and updating @inode->i_blocks
  *	appropriately.
  */
-static inline void ext2_free_data(struct inode *inode, __le32 *p, __le32 *q)
+static inline void ext2_free_data(struct ext2_free_batch *fb,
+				  __le32 *p, __le32 *q)
 {
 	ext2_fsblk_t block_to_free = 0, count = 0;
 	ext2_fsblk_t nr;
@@ -1099,23 +1707,37 @@ static inline void ext2_free_data(struct inode *inode, __le32 *p, __le32 *q)
 			else if (block_to_free == nr - count)
 				count++;
 			else {
-				ext2_free_blocks (inode, block_to_free, count);
-				mark_inode_dirty(inode);
+				ext2_free_batch_add(fb, block_to_free, count);
 			free_this:
 				block_to_free = nr;
 				count = 1;
 			}
 		}
 	}
-	if (count > 0) {
-		ext2_free_blocks (inode, block_to_free, count);
-		mark_inode_dirty(inode);
-	}
+	if (count > 0)
+		ext2_free_batch_add(fb, block_to_free, count);
+}
+
+/*
+ * Start reads of all the indirect blocks referred from [p, q) at once, so
+ * that the walk below finds them in the buffer cache instead of waiting for
+ * each one in turn.
+ */
+static void ext2_readahead_branches(struct super_block *sb,
+				    __le32 *p, __le32 *q)
+{
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	for ( ; p < q ; p++)
+		if (*p)
+			sb_breadahead(sb, le32_to_cpu(*p));
+	blk_finish_plug(&plug);
 }
 
 /**
  *	ext2_free_branches - free an array of branches
- *	@inode:	inode we are dealing with
+ *	@fb:	batch the blocks are queued on
  *	@p:	array of block numbers
  *	@q:	pointer immediately past the end of array
  *	@depth:	depth of the branches to free
@@ -1124,13 +1746,18 @@ static inline void ext2_free_data(struct inode *inode, __le32 *p, __le32 *q)
  *	stored as little-endian 32-bit) and updating @inode->i_blocks
  *	appropriately.
  */
-static void ext2_free_branches(struct inode *inode, __le32 *p, __le32 *q, int depth)
+static void ext2_free_branches(struct ext2_free_batch *fb,
+			       __le32 *p, __le32 *q, int depth)
 {
+	struct inode *inode = fb->fb_inode;
 	struct buffer_head * bh;
 	ext2_fsblk_t nr;
 
 	if (depth--) {
 		int addr_per_block = EXT2_ADDR_PER_BLOCK(inode->i_sb);
+
+		if (q - p > 1)
+			ext2_readahead_branches(inode->i_sb, p, q);
 		for ( ; p < q ; p++) {
 			nr = le32_to_cpu(*p);
 			if (!nr)
@@ -1147,16 +1774,15 @@ static void ext2_free_branches(struct inode *inode, __le32 *p, __le32 *q, int de
 					inode->i_ino, nr);
 				continue;
 			}
-			ext2_free_branches(inode,
+			ext2_free_branches(fb,
 					   (__le32*)bh->b_data,
 					   (__le32*)bh->b_data + addr_per_block,
 					   depth);
 			bforget(bh);
-			ext2_free_blocks(inode, nr, 1);
-			mark_inode_dirty(inode);
+			ext2_free_batch_add(fb, nr, 1);
 		}
 	} else
-		ext2_free_data(inode, p, q);
+		ext2_free_data(fb, p, q);
 }
 
 /* mapping->invalidate_lock must be held when calling this function */
@@ -1168,6 +1794,7 @@ static void __ext2_truncate_blocks(struct inode *inode, loff_t offset)
 	int offsets[4];
 	Indirect chain[4];
 	Indirect *partial;
+	struct ext2_free_batch fb = { .fb_inode = inode };
 	__le32 nr = 0;
 	int n;
 	long iblock;
@@ -1190,7 +1817,7 @@ static void __ext2_truncate_blocks(struct inode *inode, loff_t offset)
 	mutex_lock(&ei->truncate_mutex);
 
 	if (n == 1) {
-		ext2_free_data(inode, i_data+offsets[0],
+		ext2_free_data(&fb, i_data+offsets[0],
 					i_data + EXT2_NDIR_BLOCKS);
 		goto do_indirects;
 	}
@@ -1202,11 +1829,11 @@ static void __ext2_truncate_blocks(struct inode *inode, loff_t offset)
 			mark_inode_dirty(inode);
 		else
 			mark_buffer_dirty_inode(partial->bh, inode);
-		ext2_free_branches(inode, &nr, &nr+1, (chain+n-1) - partial);
+		ext2_free_branches(&fb, &nr, &nr+1, (chain+n-1) - partial);
 	}
 	/* Clear the ends of indirect blocks on the shared branch */
 	while (partial > chain) {
-		ext2_free_branches(inode,
+		ext2_free_branches(&fb,
 				   partial->p + 1,
 				   (__le32*)partial->bh->b_data+addr_per_block,
 				   (chain+n-1) - partial);
@@ -1222,7 +1849,7 @@ do_indirects:
 			if (nr) {
 				i_data[EXT2_IND_BLOCK] = 0;
 				mark_inode_dirty(inode);
-				ext2_free_branches(inode, &nr, &nr+1, 1);
+				ext2_free_branches(&fb, &nr, &nr+1, 1);
 			}
 			fallthrough;
 		case EXT2_IND_BLOCK:
@@ -1230,7 +1857,7 @@ do_indirects:
 			if (nr) {
 				i_data[EXT2_DIND_BLOCK] = 0;
 				mark_inode_dirty(inode);
-				ext2_free_branches(inode, &nr, &nr+1, 2);
+				ext2_free_branches(&fb, &nr, &nr+1, 2);
 			}
 			fallthrough;
 		case EXT2_DIND_BLOCK:
@@ -1238,13 +1865,14 @@ do_indirects:
 			if (nr) {
 				i_data[EXT2_TIND_BLOCK] = 0;
 				mark_inode_dirty(inode);
-				ext2_free_branches(inode, &nr, &nr+1, 3);
+				ext2_free_branches(&fb, &nr, &nr+1, 3);
 			}
 			break;
 		case EXT2_TIND_BLOCK:
 			;
 	}
 
+	ext2_free_batch_flush(&fb);
 	ext2_discard_reservation(inode);
 
 	mutex_unlock(&ei->truncate_mutex);
@@ -1263,6 +1891,20 @@ static void ext2_truncate_blocks(struct inode *inode, loff_t offset)
 	filemap_invalidate_unlock(inode->i_mapping);
 }
 
+/*
+ * Cut @inode down to @newsize, which must be block aligned and cover every
+ * block still in use, e.g. the empty tail of a compacted directory.  Unlike
+ * a truncate through setattr the timestamps are left alone.
+ */
+void ext2_shrink_blocks(struct inode *inode, loff_t newsize)
+{
+	filemap_invalidate_lock(inode->i_mapping);
+	truncate_setsize(inode, newsize);
+	__ext2_truncate_blocks(inode, newsize);
+	filemap_invalidate_unlock(inode->i_mapping);
+	mark_inode_dirty(inode);
+}
+
 static int ext2_setsize(struct inode *inode, loff_t newsize)
 {
 	int error;
@@ -1277,6 +1919,18 @@ static int ext2_setsize(struct inode *inode, loff_t newsize)
 
 	inode_dio_wait(inode);
 
+	/*
+	 * A failed asynchronous extending write may have left blocks with
+	 * stale contents past i_dio_limit.  Drop them before i_size can be
+	 * moved over them.
+	 */
+	if (EXT2_I(inode)->i_dio_limit < newsize) {
+		filemap_invalidate_lock(inode->i_mapping);
+		__ext2_truncate_blocks(inode, EXT2_I(inode)->i_dio_limit);
+		filemap_invalidate_unlock(inode->i_mapping);
+	}
+	EXT2_I(inode)->i_dio_limit = LLONG_MAX;
+
 	if (IS_DAX(inode))
 		error = dax_truncate_page(inode, newsize, NULL,
 					  &ext2_iomap_ops);
@@ -17,6 +17,7 @@
 #include <asm/current.h>
 #include <linux/uaccess.h>
 #include <linux/fileattr.h>
+#include <linux/blkdev.h>
 
 int ext2_fileattr_get(struct dentry *dentry, struct fileattr *fa)
 {
@@ -135,6 +136,118 @@ setversion_out:
 		mnt_drop_write_file(filp);
 		return ret;
 	}
+	case EXT2_IOC_COMPACT_DIR:
+		if (!S_ISDIR(inode->i_mode))
+			return -ENOTDIR;
+		if (!inode_owner_or_capable(&nop_mnt_idmap, inode))
+			return -EPERM;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		inode_lock(inode);
+		if (IS_DEADDIR(inode))
+			ret = -ENOENT;
+		else
+			ret = ext2_compact_dir(inode, filp);
+		inode_unlock(inode);
+		mnt_drop_write_file(filp);
+		return ret;
+	case EXT2_IOC_BULKSTAT: {
+		struct ext2_bulkstat bs;
+
+		if (!S_ISDIR(inode->i_mode))
+			return -ENOTDIR;
+		if (copy_from_user(&bs, (struct ext2_bulkstat __user *)arg,
+				   sizeof(bs)))
+			return -EFAULT;
+		if (bs.bs_flags & ~EXT2_BULKSTAT_CRTIME)
+			return -EINVAL;
+		/* stat() of the entries needs search permission */
+		ret = inode_permission(&nop_mnt_idmap, inode, MAY_EXEC);
+		if (ret)
+			return ret;
+		ret = ext2_bulkstat(filp, &bs);
+		if (ret)
+			return ret;
+		if (copy_to_user((struct ext2_bulkstat __user *)arg, &bs,
+				 sizeof(bs)))
+			return -EFAULT;
+		return 0;
+	}
+	case EXT2_IOC_DEFRAG: {
+		struct ext2_defrag df;
+
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (IS_IMMUTABLE(inode) || IS_APPEND(inode))
+			return -EPERM;
+		if (copy_from_user(&df, (struct ext2_defrag __user *)arg,
+				   sizeof(df)))
+			return -EFAULT;
+		if (df.df_flags || df.df_reserved)
+			return -EINVAL;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		ret = ext2_defrag(inode, &df);
+		mnt_drop_write_file(filp);
+		if (ret)
+			return ret;
+		if (copy_to_user((struct ext2_defrag __user *)arg, &df,
+				 sizeof(df)))
+			return -EFAULT;
+		return 0;
+	}
+	case EXT2_IOC_FRAGSTAT: {
+		struct ext2_fragstat fr;
+
+		if (copy_from_user(&fr, (struct ext2_fragstat __user *)arg,
+				   sizeof(fr)))
+			return -EFAULT;
+		if ((fr.fr_flags & ~(EXT2_FRAGSTAT_FS |
+				     EXT2_FRAGSTAT_PARALLEL)) ||
+		    fr.fr_reserved)
+			return -EINVAL;
+		memset(&fr.fr_blocks, 0, sizeof(fr) -
+		       offsetof(struct ext2_fragstat, fr_blocks));
+		if (fr.fr_flags & EXT2_FRAGSTAT_FS) {
+			/* it reads every bitmap */
+			if (!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			ret = ext2_fs_fragstat(inode->i_sb, &fr);
+		} else if (S_ISREG(inode->i_mode)) {
+			ret = ext2_file_fragstat(inode, &fr);
+		} else {
+			return -EINVAL;
+		}
+		if (ret)
+			return ret;
+		if (copy_to_user((struct ext2_fragstat __user *)arg, &fr,
+				 sizeof(fr)))
+			return -EFAULT;
+		return 0;
+	}
+	case FITRIM: {
+		struct super_block *sb = inode->i_sb;
+		struct fstrim_range range;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (!bdev_max_discard_sectors(sb->s_bdev))
+			return -EOPNOTSUPP;
+		if (copy_from_user(&range, (struct fstrim_range __user *)arg,
+				   sizeof(range)))
+			return -EFAULT;
+		ret = ext2_trim_fs(sb, &range);
+		if (ret)
+			return ret;
+		if (copy_to_user((struct fstrim_range __user *)arg, &range,
+				 sizeof(range)))
+			return -EFAULT;
+		return 0;
+	}
 	default:
 		return -ENOTTY;
 	}
@@ -151,6 +264,12 @@ long ext2_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case EXT2_IOC32_SETVERSION:
 		cmd = EXT2_IOC_SETVERSION;
 		break;
+	case EXT2_IOC_COMPACT_DIR:
+	case EXT2_IOC_BULKSTAT:
+	case EXT2_IOC_DEFRAG:
+	case EXT2_IOC_FRAGSTAT:
+	case FITRIM:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
@@ -89,6 +89,28 @@ static inline void set_creation_time(struct inode *inode){
 	}
 }
 
+/*
+ * Read back the time stored by set_creation_time(), in seconds since the
+ * epoch, or 0 if the inode has none.
+ */
+time64_t ext2_creation_time(struct inode *inode)
+{
+	const int timezone_offset = 7 * 3600;
+	unsigned int hour, min, mday, mon, year;
+	char time_str[17];
+	int len;
+
+	len = ext2_xattr_get(inode, EXT2_XATTR_INDEX_USER, "creation_time",
+			     time_str, sizeof(time_str));
+	if (len <= 0)
+		return 0;
+	time_str[len - 1] = '\0';
+	if (sscanf(time_str, "%u:%u %u/%u/%u", &hour, &min, &mday, &mon,
+		   &year) != 5)
+		return 0;
+	return mktime64(year, mon, mday, hour, min, 0) - timezone_offset;
+}
+
 static inline int ext2_add_nondir(struct dentry *dentry, struct inode *inode)
 {
 	int err = ext2_add_link(dentry, inode);
@@ -118,6 +140,7 @@ static struct dentry *ext2_lookup(struct inode * dir, struct dentry *dentry, uns
 	if (res) {
 		if (res != -ENOENT)
 			return ERR_PTR(res);
+		ext2_note_negative(dir, dentry);
 		inode = NULL;
 	} else {
 		inode = ext2_iget(dir->i_sb, ino);
@@ -153,6 +153,13 @@ static void ext2_put_super (struct super_block * sb)
 	int i;
 	struct ext2_sb_info *sbi = EXT2_SB(sb);
 
+	flush_work(&sbi->s_orphan_work);
+	flush_delayed_work(&sbi->s_discard_work);
+	cancel_delayed_work_sync(&sbi->s_compact_work);
+	cancel_delayed_work_sync(&sbi->s_itable_work);
+	ext2_flush_ino_pools(sb);
+	cancel_delayed_work_sync(&sbi->s_idelta_work);
+	ext2_fold_inode_deltas(sb);
 	ext2_quota_off_umount(sb);
 
 	ext2_xattr_destroy_cache(sbi->s_ea_block_cache);
@@ -175,8 +182,12 @@ static void ext2_put_super (struct super_block * sb)
 	db_count = sbi->s_gdb_count;
 	for (i = 0; i < db_count; i++)
 		brelse(sbi->s_group_desc[i]);
+	ext2_destroy_bitmap_cache(sb);
 	kvfree(sbi->s_group_desc);
+	kvfree(sbi->s_group_info);
+	kvfree(sbi->s_group_locks);
 	kfree(sbi->s_debts);
+	free_percpu(sbi->s_inode_deltas);
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
@@ -197,6 +208,15 @@ static struct inode *ext2_alloc_inode(struct super_block *sb)
 	if (!ei)
 		return NULL;
 	ei->i_block_alloc_info = NULL;
+	ei->i_dio_limit = LLONG_MAX;
+	ei->i_dir_cache = NULL;
+	ei->i_neg_dentry = NULL;
+	ei->i_dir_gaps = NULL;
+	ei->i_dir_gaps_nr = 0;
+	ei->i_dir_entries = -1;
+	atomic_set(&ei->i_dir_openers, 0);
+	ei->i_last_alloc_ino = 0;
+	ei->i_pool_next = ei->i_pool_end = 0;
 	inode_set_iversion(&ei->vfs_inode, 1);
 #ifdef CONFIG_QUOTA
 	memset(&ei->i_dquot, 0, sizeof(ei->i_dquot));
@@ -219,6 +239,12 @@ static void init_once(void *foo)
 	init_rwsem(&ei->xattr_sem);
 #endif
 	mutex_init(&ei->truncate_mutex);
+	spin_lock_init(&ei->i_dio_lock);
+	INIT_LIST_HEAD(&ei->i_dio_extends);
+	INIT_LIST_HEAD(&ei->i_orphan);
+	INIT_LIST_HEAD(&ei->i_compact);
+	INIT_LIST_HEAD(&ei->i_pool_list);
+	spin_lock_init(&ei->i_dir_cache_lock);
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -323,6 +349,25 @@ static int ext2_show_options(struct seq_file *seq, struct dentry *root)
 
 	if (!test_opt(sb, RESERVATION))
 		seq_puts(seq, ",noreservation");
+	if (!test_opt(sb, READDIR_RA))
+		seq_puts(seq, ",noreaddir_ra");
+
+	if (test_opt(sb, DEFER_FREE))
+		seq_puts(seq, ",defer_free");
+	if (test_opt(sb, DIRCACHE))
+		seq_puts(seq, ",dircache");
+	if (test_opt(sb, AUTOCOMPACT))
+		seq_puts(seq, ",autocompact");
+	if (test_opt(sb, INODE_POOL))
+		seq_puts(seq, ",inode_pool");
+	if (test_opt(sb, NUMA_GROUPS))
+		seq_puts(seq, ",numa_groups");
+	if (!test_opt(sb, INIT_ITABLE))
+		seq_puts(seq, ",noinit_itable");
+	if (test_opt(sb, LAZY_GDT))
+		seq_puts(seq, ",lazy_gdt");
+	if (test_opt(sb, DISCARD))
+		seq_puts(seq, ",discard");
 
 	spin_unlock(&sbi->s_lock);
 	return 0;
@@ -354,6 +399,7 @@ static const struct super_operations ext2_sops = {
 	.alloc_inode	= ext2_alloc_inode,
 	.free_inode	= ext2_free_in_core_inode,
 	.write_inode	= ext2_write_inode,
+	.drop_inode	= ext2_drop_inode,
 	.evict_inode	= ext2_evict_inode,
 	.put_super	= ext2_put_super,
 	.sync_fs	= ext2_sync_fs,
@@ -442,7 +488,12 @@ enum {
 	Opt_err_ro, Opt_nouid32, Opt_debug,
 	Opt_oldalloc, Opt_orlov, Opt_nobh, Opt_user_xattr, Opt_nouser_xattr,
 	Opt_acl, Opt_noacl, Opt_xip, Opt_dax, Opt_ignore, Opt_err, Opt_quota,
-	Opt_usrquota, Opt_grpquota, Opt_reservation, Opt_noreservation
+	Opt_usrquota, Opt_grpquota, Opt_reservation, Opt_noreservation,
+	Opt_defer_free, Opt_nodefer_free, Opt_dircache, Opt_nodircache,
+	Opt_autocompact, Opt_noautocompact, Opt_readdir_ra, Opt_noreaddir_ra,
+	Opt_inode_pool, Opt_noinode_pool, Opt_numa_groups, Opt_nonuma_groups,
+	Opt_init_itable, Opt_noinit_itable, Opt_lazy_gdt, Opt_nolazy_gdt,
+	Opt_discard, Opt_nodiscard
 };
 
 static const match_table_t tokens = {
@@ -475,6 +526,24 @@ static const match_table_t tokens = {
 	{Opt_usrquota, "usrquota"},
 	{Opt_reservation, "reservation"},
 	{Opt_noreservation, "noreservation"},
+	{Opt_defer_free, "defer_free"},
+	{Opt_nodefer_free, "nodefer_free"},
+	{Opt_dircache, "dircache"},
+	{Opt_nodircache, "nodircache"},
+	{Opt_autocompact, "autocompact"},
+	{Opt_noautocompact, "noautocompact"},
+	{Opt_readdir_ra, "readdir_ra"},
+	{Opt_noreaddir_ra, "noreaddir_ra"},
+	{Opt_inode_pool, "inode_pool"},
+	{Opt_noinode_pool, "noinode_pool"},
+	{Opt_numa_groups, "numa_groups"},
+	{Opt_nonuma_groups, "nonuma_groups"},
+	{Opt_init_itable, "init_itable"},
+	{Opt_noinit_itable, "noinit_itable"},
+	{Opt_lazy_gdt, "lazy_gdt"},
+	{Opt_nolazy_gdt, "nolazy_gdt"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
 	{Opt_err, NULL}
 };
 
@@ -633,6 +702,60 @@ static int parse_options(char *options, struct super_block *sb,
 			clear_opt(opts->s_mount_opt, RESERVATION);
 			ext2_msg(sb, KERN_INFO, "reservations OFF");
 			break;
+		case Opt_defer_free:
+			set_opt(opts->s_mount_opt, DEFER_FREE);
+			break;
+		case Opt_nodefer_free:
+			clear_opt(opts->s_mount_opt, DEFER_FREE);
+			break;
+		case Opt_dircache:
+			set_opt(opts->s_mount_opt, DIRCACHE);
+			break;
+		case Opt_nodircache:
+			clear_opt(opts->s_mount_opt, DIRCACHE);
+			break;
+		case Opt_autocompact:
+			set_opt(opts->s_mount_opt, AUTOCOMPACT);
+			break;
+		case Opt_noautocompact:
+			clear_opt(opts->s_mount_opt, AUTOCOMPACT);
+			break;
+		case Opt_readdir_ra:
+			set_opt(opts->s_mount_opt, READDIR_RA);
+			break;
+		case Opt_noreaddir_ra:
+			clear_opt(opts->s_mount_opt, READDIR_RA);
+			break;
+		case Opt_inode_pool:
+			set_opt(opts->s_mount_opt, INODE_POOL);
+			break;
+		case Opt_noinode_pool:
+			clear_opt(opts->s_mount_opt, INODE_POOL);
+			break;
+		case Opt_numa_groups:
+			set_opt(opts->s_mount_opt, NUMA_GROUPS);
+			break;
+		case Opt_nonuma_groups:
+			clear_opt(opts->s_mount_opt, NUMA_GROUPS);
+			break;
+		case Opt_init_itable:
+			set_opt(opts->s_mount_opt, INIT_ITABLE);
+			break;
+		case Opt_noinit_itable:
+			clear_opt(opts->s_mount_opt, INIT_ITABLE);
+			break;
+		case Opt_lazy_gdt:
+			set_opt(opts->s_mount_opt, LAZY_GDT);
+			break;
+		case Opt_nolazy_gdt:
+			clear_opt(opts->s_mount_opt, LAZY_GDT);
+			break;
+		case Opt_discard:
+			set_opt(opts->s_mount_opt, DISCARD);
+			break;
+		case Opt_nodiscard:
+			clear_opt(opts->s_mount_opt, DISCARD);
+			break;
 		case Opt_ignore:
 			break;
 		default:
@@ -692,48 +815,127 @@ static int ext2_setup_super (struct super_block * sb,
 	return res;
 }
 
-static int ext2_check_descriptors(struct super_block *sb)
+/*
+ * Descriptors are checked in chunks of EXT2_DESC_CHECK_CHUNK groups, one
+ * work item per chunk, and the free block, free inode and directory totals
+ * the counters start from are summed on the way.
+ */
+#define EXT2_DESC_CHECK_CHUNK	1024
+
+struct ext2_desc_check {
+	struct work_struct	work;
+	struct super_block	*sb;
+	unsigned long		first, end;
+	unsigned long		free_blocks;
+	unsigned long		free_inodes;
+	unsigned long		dirs;
+	int			ok;
+};
+
+static bool ext2_check_group_desc(struct super_block *sb, unsigned long i,
+				  struct ext2_group_desc *gdp)
 {
-	int i;
 	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	ext2_fsblk_t first_block = ext2_group_first_block_no(sb, i);
+	ext2_fsblk_t last_block = ext2_group_last_block_no(sb, i);
+
+	if (le32_to_cpu(gdp->bg_block_bitmap) < first_block ||
+	    le32_to_cpu(gdp->bg_block_bitmap) > last_block)
+	{
+		ext2_error (sb, "ext2_check_descriptors",
+			    "Block bitmap for group %lu"
+			    " not in group (block %lu)!",
+			    i, (unsigned long) le32_to_cpu(gdp->bg_block_bitmap));
+		return false;
+	}
+	if (le32_to_cpu(gdp->bg_inode_bitmap) < first_block ||
+	    le32_to_cpu(gdp->bg_inode_bitmap) > last_block)
+	{
+		ext2_error (sb, "ext2_check_descriptors",
+			    "Inode bitmap for group %lu"
+			    " not in group (block %lu)!",
+			    i, (unsigned long) le32_to_cpu(gdp->bg_inode_bitmap));
+		return false;
+	}
+	if (le32_to_cpu(gdp->bg_inode_table) < first_block ||
+	    le32_to_cpu(gdp->bg_inode_table) + sbi->s_itb_per_group - 1 >
+	    last_block)
+	{
+		ext2_error (sb, "ext2_check_descriptors",
+			    "Inode table for group %lu"
+			    " not in group (block %lu)!",
+			    i, (unsigned long) le32_to_cpu(gdp->bg_inode_table));
+		return false;
+	}
+	if (!ext2_group_desc_csum_verify(sb, i, gdp)) {
+		ext2_error (sb, "ext2_check_descriptors",
+			    "Checksum for group %lu mismatch", i);
+		return false;
+	}
+	return true;
+}
 
-	ext2_debug ("Checking group descriptors");
+static void ext2_check_desc_range(struct ext2_desc_check *c)
+{
+	struct super_block *sb = c->sb;
+	unsigned long i;
 
-	for (i = 0; i < sbi->s_groups_count; i++) {
+	c->ok = 0;
+	for (i = c->first; i < c->end; i++) {
 		struct ext2_group_desc *gdp = ext2_get_group_desc(sb, i, NULL);
-		ext2_fsblk_t first_block = ext2_group_first_block_no(sb, i);
-		ext2_fsblk_t last_block = ext2_group_last_block_no(sb, i);
-
-		if (le32_to_cpu(gdp->bg_block_bitmap) < first_block ||
-		    le32_to_cpu(gdp->bg_block_bitmap) > last_block)
-		{
-			ext2_error (sb, "ext2_check_descriptors",
-				    "Block bitmap for group %d"
-				    " not in group (block %lu)!",
-				    i, (unsigned long) le32_to_cpu(gdp->bg_block_bitmap));
-			return 0;
-		}
-		if (le32_to_cpu(gdp->bg_inode_bitmap) < first_block ||
-		    le32_to_cpu(gdp->bg_inode_bitmap) > last_block)
-		{
-			ext2_error (sb, "ext2_check_descriptors",
-				    "Inode bitmap for group %d"
-				    " not in group (block %lu)!",
-				    i, (unsigned long) le32_to_cpu(gdp->bg_inode_bitmap));
-			return 0;
-		}
-		if (le32_to_cpu(gdp->bg_inode_table) < first_block ||
-		    le32_to_cpu(gdp->bg_inode_table) + sbi->s_itb_per_group - 1 >
-		    last_block)
-		{
-			ext2_error (sb, "ext2_check_descriptors",
-				    "Inode table for group %d"
-				    " not in group (block %lu)!",
-				    i, (unsigned long) le32_to_cpu(gdp->bg_inode_table));
-			return 0;
-		}
+
+		if (!ext2_check_group_desc(sb, i, gdp))
+			return;
+		c->free_blocks += le16_to_cpu(gdp->bg_free_blocks_count);
+		c->free_inodes += le16_to_cpu(gdp->bg_free_inodes_count);
+		c->dirs += le16_to_cpu(gdp->bg_used_dirs_count);
 	}
-	return 1;
+	c->ok = 1;
+}
+
+static void ext2_check_desc_work(struct work_struct *work)
+{
+	ext2_check_desc_range(container_of(work, struct ext2_desc_check, work));
+}
+
+static int ext2_check_descriptors(struct super_block *sb,
+				  struct ext2_desc_check *total)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_desc_check *c;
+	unsigned long chunk, nr, i;
+
+	ext2_debug ("Checking group descriptors");
+
+	memset(total, 0, sizeof(*total));
+	total->sb = sb;
+	total->end = sbi->s_groups_count;
+	nr = min_t(unsigned long, num_online_cpus(),
+		   DIV_ROUND_UP(sbi->s_groups_count, EXT2_DESC_CHECK_CHUNK));
+	c = nr > 1 ? kcalloc(nr, sizeof(*c), GFP_KERNEL) : NULL;
+	if (!c) {
+		ext2_check_desc_range(total);
+		return total->ok;
+	}
+
+	chunk = DIV_ROUND_UP(sbi->s_groups_count, nr);
+	for (i = 0; i < nr; i++) {
+		c[i].sb = sb;
+		c[i].first = i * chunk;
+		c[i].end = min(c[i].first + chunk, sbi->s_groups_count);
+		INIT_WORK(&c[i].work, ext2_check_desc_work);
+		queue_work(system_unbound_wq, &c[i].work);
+	}
+	total->ok = 1;
+	for (i = 0; i < nr; i++) {
+		flush_work(&c[i].work);
+		total->ok &= c[i].ok;
+		total->free_blocks += c[i].free_blocks;
+		total->free_inodes += c[i].free_inodes;
+		total->dirs += c[i].dirs;
+	}
+	kfree(c);
+	return total->ok;
 }
 
 /*
@@ -815,6 +1017,114 @@ static unsigned long descriptor_loc(struct super_block *sb,
 	return ext2_group_first_block_no(sb, bg) + ext2_bg_has_super(sb, bg);
 }
 
+/*
+ * With -o lazy_gdt the group descriptor blocks are not read at mount.
+ * Each is read and checked the first time one of its groups is needed;
+ * the loops over all groups skip the ones not read yet, and only an
+ * allocation that finds no room elsewhere reads the rest.  So a block is
+ * only resident once something has used one of its groups.  A block once
+ * read stays pinned until umount, as with the eager path, since callers
+ * keep pointers into it.
+ */
+#define EXT2_GDT_READAHEAD	32
+
+/*
+ * Until every descriptor is in, the counters carry the superblock totals
+ * the mount started from, and only the directories of the groups read so
+ * far.  Replace them with the sums of the descriptors, which is what a
+ * full mount starts from.  Allocations in flight may be counted in one and
+ * not yet in the other, as with any read of the counters.
+ */
+static void ext2_sum_group_descs(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_desc *gdp;
+	unsigned long free_blocks = 0, free_inodes = 0, dirs = 0, i;
+
+	ext2_fold_inode_deltas(sb);
+	for (i = 0; i < sbi->s_groups_count; i++) {
+		gdp = ext2_get_group_desc(sb, i, NULL);
+		if (!gdp)
+			continue;
+		free_blocks += le16_to_cpu(gdp->bg_free_blocks_count);
+		free_inodes += le16_to_cpu(gdp->bg_free_inodes_count);
+		dirs += le16_to_cpu(gdp->bg_used_dirs_count);
+	}
+	percpu_counter_set(&sbi->s_freeblocks_counter, free_blocks);
+	percpu_counter_set(&sbi->s_freeinodes_counter, free_inodes);
+	percpu_counter_set(&sbi->s_dirs_counter, dirs);
+}
+
+int ext2_load_group_desc(struct super_block *sb, unsigned long nr)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_desc *gdp;
+	struct buffer_head *bh;
+	unsigned long first, end, i;
+	long dirs = 0;
+	bool last;
+
+	bh = sb_bread(sb, descriptor_loc(sb, sbi->s_logic_sb_block, nr));
+	if (!bh) {
+		ext2_error(sb, __func__,
+			   "unable to read group descriptors block %lu", nr);
+		return -EIO;
+	}
+
+	mutex_lock(&sbi->s_gdt_mutex);
+	if (sbi->s_group_desc[nr]) {
+		mutex_unlock(&sbi->s_gdt_mutex);
+		brelse(bh);
+		return 0;
+	}
+	first = nr * EXT2_DESC_PER_BLOCK(sb);
+	end = min(first + EXT2_DESC_PER_BLOCK(sb), sbi->s_groups_count);
+	gdp = (struct ext2_group_desc *)bh->b_data;
+	for (i = first; i < end; i++, gdp++) {
+		if (!ext2_check_group_desc(sb, i, gdp)) {
+			mutex_unlock(&sbi->s_gdt_mutex);
+			brelse(bh);
+			return -EFSCORRUPTED;
+		}
+		dirs += le16_to_cpu(gdp->bg_used_dirs_count);
+	}
+	percpu_counter_add(&sbi->s_dirs_counter, dirs);
+	/* pairs with smp_load_acquire() in ext2_get_group_desc() */
+	smp_store_release(&sbi->s_group_desc[nr], bh);
+	gdp = (struct ext2_group_desc *)bh->b_data;
+	for (i = first; i < end; i++, gdp++)
+		ext2_group_info_update(sb, i, gdp);
+	WRITE_ONCE(sbi->s_gdt_loaded, sbi->s_gdt_loaded + 1);
+	last = sbi->s_gdt_loaded == sbi->s_gdb_count;
+	mutex_unlock(&sbi->s_gdt_mutex);
+	if (last)
+		ext2_sum_group_descs(sb);
+	return 0;
+}
+
+/* Read every descriptor block not read yet, for an allocator out of room. */
+void ext2_load_group_descs(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct blk_plug plug;
+	unsigned long i, j, end;
+
+	for (i = 0; i < sbi->s_gdb_count; i = end) {
+		end = min(i + EXT2_GDT_READAHEAD, sbi->s_gdb_count);
+		blk_start_plug(&plug);
+		for (j = i; j < end; j++)
+			if (!READ_ONCE(sbi->s_group_desc[j]))
+				sb_breadahead(sb, descriptor_loc(sb,
+						sbi->s_logic_sb_block, j));
+		blk_finish_plug(&plug);
+		for (j = i; j < end; j++)
+			if (!READ_ONCE(sbi->s_group_desc[j]) &&
+			    ext2_load_group_desc(sb, j))
+				return;
+		cond_resched();
+	}
+}
+
 static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head * bh;
@@ -833,6 +1143,8 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	__le32 features;
 	int err;
 	struct ext2_mount_options opts;
+	struct ext2_desc_check counts;
+	struct blk_plug plug;
 
 	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
 	if (!sbi)
@@ -850,6 +1162,21 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 					   NULL, NULL);
 
 	spin_lock_init(&sbi->s_lock);
+	sbi->s_sb = sb;
+	spin_lock_init(&sbi->s_orphan_lock);
+	INIT_LIST_HEAD(&sbi->s_orphan_list);
+	INIT_WORK(&sbi->s_orphan_work, ext2_orphan_work);
+	spin_lock_init(&sbi->s_compact_lock);
+	INIT_LIST_HEAD(&sbi->s_compact_list);
+	INIT_DELAYED_WORK(&sbi->s_compact_work, ext2_compact_work);
+	spin_lock_init(&sbi->s_ino_pool_lock);
+	INIT_LIST_HEAD(&sbi->s_ino_pools);
+	INIT_DELAYED_WORK(&sbi->s_itable_work, ext2_itable_work);
+	init_rwsem(&sbi->s_itable_sem);
+	mutex_init(&sbi->s_gdt_mutex);
+	spin_lock_init(&sbi->s_discard_lock);
+	INIT_LIST_HEAD(&sbi->s_discard_list);
+	INIT_DELAYED_WORK(&sbi->s_discard_work, ext2_discard_work);
 	ret = -EINVAL;
 
 	/*
@@ -920,6 +1247,8 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	opts.s_resgid = make_kgid(&init_user_ns, le16_to_cpu(es->s_def_resgid));
 	
 	set_opt(opts.s_mount_opt, RESERVATION);
+	set_opt(opts.s_mount_opt, READDIR_RA);
+	set_opt(opts.s_mount_opt, INIT_ITABLE);
 
 	if (!parse_options((char *) data, sb, &opts))
 		goto failed_mount;
@@ -932,6 +1261,12 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 		(test_opt(sb, POSIX_ACL) ? SB_POSIXACL : 0);
 	sb->s_iflags |= SB_I_CGROUPWB;
 
+	if (test_opt(sb, DISCARD) && !bdev_max_discard_sectors(sb->s_bdev)) {
+		ext2_msg(sb, KERN_WARNING,
+			 "warning: discard not supported by device, disabled");
+		clear_opt(sbi->s_mount_opt, DISCARD);
+	}
+
 	if (le32_to_cpu(es->s_rev_level) == EXT2_GOOD_OLD_REV &&
 	    (EXT2_HAS_COMPAT_FEATURE(sb, ~0U) ||
 	     EXT2_HAS_RO_COMPAT_FEATURE(sb, ~0U) ||
@@ -1042,6 +1377,34 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->s_desc_per_block_bits =
 		ilog2 (EXT2_DESC_PER_BLOCK(sb));
 
+	for (i = 0; i < 4; i++)
+		sbi->s_hash_seed[i] = le32_to_cpu(es->s_hash_seed[i]);
+	sbi->s_def_hash_version = es->s_def_hash_version;
+	if (sbi->s_def_hash_version > EXT2_DX_HASH_TEA)
+		sbi->s_def_hash_version = EXT2_DX_HASH_HALF_MD4;
+	if (EXT2_HAS_COMPAT_FEATURE(sb, EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		u32 flags = le32_to_cpu(es->s_flags);
+
+		/*
+		 * Directory hashes used to depend on the signedness of char;
+		 * pin down which one this filesystem uses.
+		 */
+		if (flags & EXT2_FLAGS_UNSIGNED_HASH)
+			sbi->s_hash_unsigned = 3;
+		else if ((flags & EXT2_FLAGS_SIGNED_HASH) == 0) {
+#ifdef __CHAR_UNSIGNED__
+			if (!sb_rdonly(sb))
+				es->s_flags |=
+					cpu_to_le32(EXT2_FLAGS_UNSIGNED_HASH);
+			sbi->s_hash_unsigned = 3;
+#else
+			if (!sb_rdonly(sb))
+				es->s_flags |=
+					cpu_to_le32(EXT2_FLAGS_SIGNED_HASH);
+#endif
+		}
+	}
+
 	if (sb->s_magic != EXT2_SUPER_MAGIC)
 		goto cantfind_ext2;
 
@@ -1098,21 +1461,60 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	db_count = (sbi->s_groups_count + EXT2_DESC_PER_BLOCK(sb) - 1) /
 		   EXT2_DESC_PER_BLOCK(sb);
-	sbi->s_group_desc = kvmalloc_array(db_count,
-					   sizeof(struct buffer_head *),
-					   GFP_KERNEL);
+	sbi->s_group_desc = kvcalloc(db_count, sizeof(struct buffer_head *),
+				     GFP_KERNEL);
 	if (sbi->s_group_desc == NULL) {
 		ret = -ENOMEM;
 		ext2_msg(sb, KERN_ERR, "error: not enough memory");
 		goto failed_mount;
 	}
 	bgl_lock_init(sbi->s_blockgroup_lock);
+	if (test_opt(sb, NUMA_GROUPS)) {
+		sbi->s_group_locks = kvmalloc_array(sbi->s_groups_count,
+						    sizeof(spinlock_t),
+						    GFP_KERNEL);
+		if (!sbi->s_group_locks) {
+			ret = -ENOMEM;
+			ext2_msg(sb, KERN_ERR, "error: not enough memory");
+			goto failed_mount_group_desc;
+		}
+		for (i = 0; i < sbi->s_groups_count; i++)
+			spin_lock_init(&sbi->s_group_locks[i]);
+	}
 	sbi->s_debts = kcalloc(sbi->s_groups_count, sizeof(*sbi->s_debts), GFP_KERNEL);
 	if (!sbi->s_debts) {
 		ret = -ENOMEM;
 		ext2_msg(sb, KERN_ERR, "error: not enough memory");
 		goto failed_mount_group_desc;
 	}
+	if (ext2_init_inode_deltas(sb)) {
+		ret = -ENOMEM;
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount_group_desc;
+	}
+	sbi->s_logic_sb_block = logic_sb_block;
+	/* after a crash the superblock totals may be anything */
+	if (test_opt(sb, LAZY_GDT) && !(sbi->s_mount_state & EXT2_VALID_FS)) {
+		ext2_msg(sb, KERN_WARNING, "warning: not cleanly unmounted, "
+			 "reading all group descriptors");
+		clear_opt(sbi->s_mount_opt, LAZY_GDT);
+	}
+	if (test_opt(sb, LAZY_GDT)) {
+		/*
+		 * Descriptors are read as they are needed; until then the
+		 * superblock totals stand in for theirs.
+		 */
+		memset(&counts, 0, sizeof(counts));
+		counts.free_blocks = le32_to_cpu(es->s_free_blocks_count);
+		counts.free_inodes = le32_to_cpu(es->s_free_inodes_count);
+		sbi->s_gdb_count = db_count;
+		goto group_info;
+	}
+	/* have all descriptor blocks in flight before waiting for any */
+	blk_start_plug(&plug);
+	for (i = 0; i < db_count; i++)
+		sb_breadahead(sb, descriptor_loc(sb, logic_sb_block, i));
+	blk_finish_plug(&plug);
 	for (i = 0; i < db_count; i++) {
 		block = descriptor_loc(sb, logic_sb_block, i);
 		sbi->s_group_desc[i] = sb_bread(sb, block);
@@ -1124,11 +1526,23 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 			goto failed_mount_group_desc;
 		}
 	}
-	if (!ext2_check_descriptors (sb)) {
+	if (!ext2_check_descriptors(sb, &counts)) {
 		ext2_msg(sb, KERN_ERR, "group descriptors corrupted");
 		goto failed_mount2;
 	}
 	sbi->s_gdb_count = db_count;
+	sbi->s_gdt_loaded = db_count;
+group_info:
+	if (ext2_init_group_info(sb)) {
+		ret = -ENOMEM;
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount2;
+	}
+	if (ext2_init_bitmap_cache(sb)) {
+		ret = -ENOMEM;
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount2;
+	}
 	get_random_bytes(&sbi->s_next_generation, sizeof(u32));
 	spin_lock_init(&sbi->s_next_gen_lock);
 
@@ -1148,14 +1562,14 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	ext2_rsv_window_add(sb, &sbi->s_rsv_window_head);
 
 	err = percpu_counter_init(&sbi->s_freeblocks_counter,
-				ext2_count_free_blocks(sb), GFP_KERNEL);
+				counts.free_blocks, GFP_KERNEL);
 	if (!err) {
 		err = percpu_counter_init(&sbi->s_freeinodes_counter,
-				ext2_count_free_inodes(sb), GFP_KERNEL);
+				counts.free_inodes, GFP_KERNEL);
 	}
 	if (!err) {
 		err = percpu_counter_init(&sbi->s_dirs_counter,
-				ext2_count_dirs(sb), GFP_KERNEL);
+				counts.dirs, GFP_KERNEL);
 	}
 	if (err) {
 		ret = err;
@@ -1217,6 +1631,7 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
     }
 	/*kết thúc*/
 
+	ext2_start_itable_init(sb);
 	return 0;
 
 cantfind_ext2:
@@ -1226,16 +1641,21 @@ cantfind_ext2:
 			sb->s_id);
 	goto failed_mount;
 failed_mount3:
+	cancel_delayed_work_sync(&sbi->s_idelta_work);
+	ext2_destroy_bitmap_cache(sb);
 	ext2_xattr_destroy_cache(sbi->s_ea_block_cache);
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 failed_mount2:
+	kvfree(sbi->s_group_info);
 	for (i = 0; i < db_count; i++)
 		brelse(sbi->s_group_desc[i]);
 failed_mount_group_desc:
 	kvfree(sbi->s_group_desc);
+	kvfree(sbi->s_group_locks);
 	kfree(sbi->s_debts);
+	free_percpu(sbi->s_inode_deltas);
 failed_mount:
 	brelse(bh);
 failed_sbi:
@@ -1296,6 +1716,21 @@ static int ext2_sync_fs(struct super_block *sb, int wait)
 	struct ext2_sb_info *sbi = EXT2_SB(sb);
 	struct ext2_super_block *es = EXT2_SB(sb)->s_es;
 
+	/*
+	 * Let deferred frees of unlinked inodes reach the bitmaps first.
+	 * Queued directory compaction stays queued: it is not needed for
+	 * consistency, and ext2_put_super() cancels it.
+	 */
+	if (wait) {
+		ext2_flush_orphans(sb);
+		/* then blocks waiting for their discard */
+		ext2_flush_discards(sb);
+		/* so do inodes reserved for new files */
+		ext2_flush_ino_pools(sb);
+	}
+	/* and the group inode counts kept per CPU reach the descriptors */
+	ext2_fold_inode_deltas(sb);
+
 	/*
 	 * Write quota structures to quota file, sync_blockdev() will write
 	 * them to disk later
@@ -1339,6 +1774,17 @@ static int ext2_unfreeze(struct super_block *sb)
 	/* Just write sb to clear EXT2_VALID_FS flag */
 	ext2_write_super(sb);
 
+	/* Deferred frees queued while frozen could not run */
+	if (ext2_orphans_pending(sb))
+		queue_work(system_unbound_wq, &EXT2_SB(sb)->s_orphan_work);
+	if (ext2_discards_pending(sb))
+		queue_delayed_work(system_unbound_wq,
+				   &EXT2_SB(sb)->s_discard_work, 0);
+	if (!list_empty_careful(&EXT2_SB(sb)->s_compact_list))
+		queue_delayed_work(system_unbound_wq,
+				   &EXT2_SB(sb)->s_compact_work, 0);
+	ext2_start_itable_init(sb);
+
 	return 0;
 }
 
@@ -1355,6 +1801,14 @@ static int ext2_remount (struct super_block * sb, int * flags, char * data)
 	struct ext2_mount_options new_opts;
 	int err;
 
+	/*
+	 * No more inode table zeroing once read-only, and no compaction:
+	 * what is still queued runs again once read-write.
+	 */
+	if (*flags & SB_RDONLY) {
+		cancel_delayed_work_sync(&sbi->s_itable_work);
+		cancel_delayed_work_sync(&sbi->s_compact_work);
+	}
 	sync_filesystem(sb);
 
 	spin_lock(&sbi->s_lock);
@@ -1373,6 +1827,18 @@ static int ext2_remount (struct super_block * sb, int * flags, char * data)
 			 "dax flag with busy inodes while remounting");
 		new_opts.s_mount_opt ^= EXT2_MOUNT_DAX;
 	}
+	/* the group locks are set up once, at mount time */
+	if ((sbi->s_mount_opt ^ new_opts.s_mount_opt) & EXT2_MOUNT_NUMA_GROUPS) {
+		ext2_msg(sb, KERN_WARNING, "warning: refusing change of "
+			 "numa_groups while remounting");
+		new_opts.s_mount_opt ^= EXT2_MOUNT_NUMA_GROUPS;
+	}
+	/* descriptors not read yet are only found with lazy_gdt set */
+	if ((sbi->s_mount_opt ^ new_opts.s_mount_opt) & EXT2_MOUNT_LAZY_GDT) {
+		ext2_msg(sb, KERN_WARNING, "warning: refusing change of "
+			 "lazy_gdt while remounting");
+		new_opts.s_mount_opt ^= EXT2_MOUNT_LAZY_GDT;
+	}
 	if ((bool)(*flags & SB_RDONLY) == sb_rdonly(sb))
 		goto out_set;
 	if (*flags & SB_RDONLY) {
@@ -1427,6 +1893,10 @@ out_set:
 	sb->s_flags = (sb->s_flags & ~SB_POSIXACL) |
 		(test_opt(sb, POSIX_ACL) ? SB_POSIXACL : 0);
 	spin_unlock(&sbi->s_lock);
+	ext2_start_itable_init(sb);
+	if (!sb_rdonly(sb) && !list_empty_careful(&sbi->s_compact_list))
+		queue_delayed_work(system_unbound_wq, &sbi->s_compact_work,
+				   0);
 
 	return 0;
 }
@@ -1482,12 +1952,18 @@ static int ext2_statfs (struct dentry * dentry, struct kstatfs * buf)
 	buf->f_blocks = le32_to_cpu(es->s_blocks_count) - sbi->s_overhead_last;
 	buf->f_bfree = ext2_count_free_blocks(sb);
 	es->s_free_blocks_count = cpu_to_le32(buf->f_bfree);
+	/* unlinked inodes waiting for deferred free count as free space */
+	buf->f_bfree += READ_ONCE(sbi->s_orphan_blocks);
+	/* and so do blocks waiting for their discard */
+	buf->f_bfree += READ_ONCE(sbi->s_discard_blocks);
 	buf->f_bavail = buf->f_bfree - le32_to_cpu(es->s_r_blocks_count);
 	if (buf->f_bfree < le32_to_cpu(es->s_r_blocks_count))
 		buf->f_bavail = 0;
 	buf->f_files = le32_to_cpu(es->s_inodes_count);
 	buf->f_ffree = ext2_count_free_inodes(sb);
 	es->s_free_inodes_count = cpu_to_le32(buf->f_ffree);
+	buf->f_ffree += READ_ONCE(sbi->s_orphan_count);
+	buf->f_ffree += READ_ONCE(sbi->s_pooled_inodes);
 	buf->f_namelen = EXT2_NAME_LEN;
 	buf->f_fsid = uuid_to_fsid(es->s_uuid);
 	spin_unlock(&sbi->s_lock);
@@ -1664,10 +2140,15 @@ static int __init init_ext2_fs(void)
 	err = init_inodecache();
 	if (err)
 		return err;
-	err = register_filesystem(&ext2_fs_type);
+	err = ext2_init_dir_cache();
 	if (err)
 		goto out;
+	err = register_filesystem(&ext2_fs_type);
+	if (err)
+		goto out_dir_cache;
 	return 0;
+out_dir_cache:
+	ext2_exit_dir_cache();
 out:
 	destroy_inodecache();
 	return err;
@@ -1676,6 +2157,7 @@ out:
 static void __exit exit_ext2_fs(void)
 {
 	unregister_filesystem(&ext2_fs_type);
+	ext2_exit_dir_cache();
 	destroy_inodecache();
 }
 